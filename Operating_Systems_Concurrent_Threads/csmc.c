@@ -3,182 +3,1127 @@
 //Libraries
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
 #include <unistd.h>
 #include <semaphore.h>
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
 
 //Defines
 #define CODING_SLEEP_TIME 200
 #define TUTORING_SLEEP_TIME 200
+#define MAXIMUM_STUDENT_WORKERS 1024    //Largest -p
+#define WAIT_HISTOGRAM_BUCKETS 40       //Chair wait times are counted in powers of two of microseconds
+#define SIMULATED_CODING_TIME 2000     //Microseconds of virtual time a student codes at most (2 ms)
+#define SIMULATED_TUTORING_TIME 200    //Microseconds of virtual time a tutoring session takes (0.2 ms)
+#define LOG_LINE_LENGTH 128        //Longest output line
+#define LOG_RING_SIZE 16           //Lines each thread can log before the logger thread must catch up
+#define LOG_FLUSH_INTERVAL 1000    //Microseconds the logger thread sleeps when there is nothing to write
+#define CACHE_LINE_SIZE 64
 
 // Data structure arguments
-int *studentsInWaitingAreaQueue = NULL;  //Students in the queue
 int *studentIdsQueue = NULL;             //ID of students
 int *studentPriorities = NULL;           //Priority of students
 int *tutorIdsQueue = NULL;               //ID of tutors
 int *tutoringFinishedQueue = NULL;       //Queue to indicate that tutoring finished
-int **priorityQueueForTutoring = NULL;   //Priority queue
+
+//A waiting student's entry in the priority queue
+typedef struct
+{
+    int priority;   //Number of times the student has been tutored
+    int sequence;   //Student's position in the waiting queue
+    int studentId;
+} TutoringRequest;
+
+//A student's arrival, passed from the student to the coordinator
+typedef struct ArrivalNode
+{
+    struct ArrivalNode *next;
+    TutoringRequest request;
+} ArrivalNode;
+
+//Each coordinator owns a partition: the arrival queue of its students and the priority queue it fills.
+//Student x belongs to partition (x - 1) % #coordinators.
+typedef struct
+{
+    //Arrival queue: lock-free, many students push and only the coordinator pops.
+    //Each student has one node, which it reuses only after it was tutored, long after the coordinator popped it.
+    ArrivalNode *arrivalQueueHead;   //Last node pushed, swapped by students
+    ArrivalNode *arrivalQueueTail;   //Next node to pop, used by the coordinator only
+    ArrivalNode arrivalQueueStub;    //Keeps the queue non-empty
+
+    //Priority queue: a binary min-heap ordered by priority, then by sequence.
+    //Only students sitting in a chair are queued, so #chairs entries are enough.
+    TutoringRequest *priorityQueueForTutoring;
+    int priorityQueueSize;
+    pthread_mutex_t queueLock;       //priorityQueueForTutoring, priorityQueueSize
+
+    sem_t semCoordinatorIsWaitingForStudent;
+} __attribute__((aligned(CACHE_LINE_SIZE))) Partition;   //Coordinators do not share cache lines
+
+ArrivalNode *studentsInWaitingAreaQueue = NULL;  //One node per student
+Partition *partitions = NULL;                    //One per coordinator
+int *coordinatorIdsQueue = NULL;                 //ID of coordinators
 
 //Input arguments
 int numberOfChairsInWaitingArea = 0; //Number of chairs
 int numberOfStudents = 0;            //Number of students 
 int numberOfTutors = 0;              //Number of tutors
 int numberOfTimesHelpRequired = 0;   //Number of times each student will take help
+int numberOfCoordinators = 1;        //Number of coordinators, optional
+int simulationMode = 0;              //-s: run as a discrete-event simulation in virtual time
+int numberOfStudentWorkers = 0;      //-p: run the students as tasks on this many threads instead of one thread each
+char *statisticsPrefix = NULL;       //-c: collect statistics and write them to CSV files starting with this prefix
+unsigned long long randomSeed = 1;   //-r: seed of the students' coding times, runs with the same seed code alike
+
+//Program related arguments
+int numberOfOccupiedChairs = 0;
+int numberOfStudentsHelped = 0;
+int totalTutoringRequests = 0;
+int totalTutoringSessionsHeld = 0;
+int studentsBeingTutoredNow = 0;
+
+//Asynchronous logging: every thread appends its output lines to its own ring, without locks,
+//and the logger thread writes them out in batches. Each line is stamped with a global sequence
+//number when it is logged, so lines come out in the same order as if they had been printed then.
+typedef struct
+{
+    unsigned long sequence;
+    char line[LOG_LINE_LENGTH];
+} LogRecord;
+
+//Written by one thread and read by the logger thread only
+typedef struct
+{
+    LogRecord records[LOG_RING_SIZE];
+    unsigned head;   //Next record to write out, advanced by the logger thread
+    unsigned tail;   //Next free record, advanced by the owning thread
+} __attribute__((aligned(CACHE_LINE_SIZE))) LogRing;   //Threads logging at once do not share cache lines
+
+LogRing *logRings = NULL;          //Students (or the workers of the pool), then tutors, then the coordinators
+int numberOfLogRings = 0;
+int numberOfStudentLogRings = 0;   //One per student, or one per worker of the pool
+__thread int workerLogId = -1;     //Ring of the pool worker running on this thread, whichever student's task it runs
+unsigned long logSequence = 0;     //Sequence number of the next line logged
+LogRecord *pendingLogRecords = NULL;  //Lines taken from the rings but not written yet, used by the logger thread only
+int loggingFinished = 0;
+
+// thread-functions
+void *coordinatorThread(void *coordinatorId);
+void *studentThread(void *studentId);
+void *tutorThread(void *tutorId);
+void *studentWorkerThread(void *workerId);
+void scheduleStudentTask(long long time, int type, int studentId, int tutorId);
+
+//Student worker pool: events holds the pending student tasks
+pthread_mutex_t studentTaskLock;    //events, numberOfEvents, eventSequence, numberOfStudentsLeft
+pthread_cond_t studentTaskReady;    //Signalled when a task is scheduled, or all students left
+int numberOfStudentsLeft = 0;       //Students whose tasks have not finished
+
+sem_t semTutorIsWaitingForCoordinator;
+//The student waits on its semaphore and its tutor posts it, so each has a cache line of its own
+typedef struct
+{
+    sem_t semaphore;
+} __attribute__((aligned(CACHE_LINE_SIZE))) StudentSemaphore;
+
+StudentSemaphore *semStudentIsWaitingForTutor = NULL;  //One per student thread, posted when its tutoring finished
+
+//Each lock guards one group of shared variables, so students, tutors and the coordinator only wait for each other when they touch the same group
+pthread_mutex_t chairsLock;                 //numberOfOccupiedChairs, totalTutoringRequests
+pthread_mutex_t statisticsLock;             //studentsBeingTutoredNow, totalTutoringSessionsHeld, numberOfStudentsHelped
+pthread_mutex_t tutoringFinishedQueueLock;  //tutoringFinishedQueue
+
+//Wait until the ring of the thread owning logRings[logId] has room for a line. A thread that logs while holding a lock
+//calls this before taking the lock, so that nobody waits on that lock while the logger thread catches up.
+//Only the owner fills its ring, so the room stays until it logs.
+void reserveLogLine(int logId)
+{
+    LogRing *ring;
+
+    if(simulationMode)
+    {
+        return;
+    }
+
+    ring = &logRings[logId];
+
+    while(ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_RING_SIZE)
+    {
+        sched_yield();
+    }
+}
+
+//Log one output line from the thread owning logRings[logId]. Only waits if the thread's ring is full and was not reserved.
+void logLine(int logId, const char *format, ...)
+{
+    LogRing *ring;
+    LogRecord *record;
+    va_list arguments;
+
+    //The simulation runs on this thread alone, without a logger thread, and prints its lines right away
+    if(simulationMode)
+    {
+        va_start(arguments, format);
+        vprintf(format, arguments);
+        va_end(arguments);
+        return;
+    }
+
+    //Wait for the logger thread to make room
+    reserveLogLine(logId);
+
+    ring = &logRings[logId];
+    record = &ring->records[ring->tail % LOG_RING_SIZE];
+    record->sequence = __atomic_fetch_add(&logSequence, 1, __ATOMIC_RELAXED);
+
+    va_start(arguments, format);
+    vsnprintf(record->line, LOG_LINE_LENGTH, format, arguments);
+    va_end(arguments);
+
+    //Hand the record to the logger thread
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+//Log ring of the thread running a student's steps: the student's own thread, or a worker of the pool
+int studentLogId(int studentId)
+{
+    return numberOfStudentWorkers > 0 ? workerLogId : studentId - 1;
+}
+
+int compareLogRecords(const void *a, const void *b)
+{
+    unsigned long sequenceA = ((const LogRecord *)a)->sequence;
+    unsigned long sequenceB = ((const LogRecord *)b)->sequence;
+
+    return (sequenceA > sequenceB) - (sequenceA < sequenceB);
+}
+
+//Collects the lines of all rings, and writes out those whose predecessors have all been written
+void *loggerThread()
+{
+    LogRing *ring;
+    LogRecord *record;
+    unsigned long nextSequence = 0;
+    int maximumPendingRecords = numberOfLogRings * LOG_RING_SIZE;
+    int numberOfPendingRecords = 0;
+    int numberOfWrittenRecords;
+    int numberOfLinesWritten;
+    int finished;
+    int tIterator;
+    unsigned tail;
+
+    while(1)
+    {
+        //Read the flag before the rings, so the last pass sees every line logged
+        finished = __atomic_load_n(&loggingFinished, __ATOMIC_ACQUIRE);
+        numberOfLinesWritten = 0;
+
+        for(tIterator = 0; tIterator < numberOfLogRings; tIterator++)
+        {
+            ring = &logRings[tIterator];
+            tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+            while(ring->head != tail)
+            {
+                record = &ring->records[ring->head % LOG_RING_SIZE];
+
+                if(numberOfPendingRecords < maximumPendingRecords)
+                {
+                    pendingLogRecords[numberOfPendingRecords++] = *record;
+                }
+                else if(record->sequence == nextSequence)
+                {
+                    //No room left while a gap holds the pending lines back; the line filling the gap goes straight out
+                    fputs(record->line, stdout);
+                    nextSequence++;
+                    numberOfLinesWritten++;
+                }
+                else
+                {
+                    //Leave the rest in the ring, its thread waits in logLine() until there is room
+                    break;
+                }
+
+                __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+            }
+        }
+
+        qsort(pendingLogRecords, numberOfPendingRecords, sizeof(LogRecord), compareLogRecords);
+
+        //A line whose sequence number was taken but not yet handed over leaves a gap; stop there
+        for(numberOfWrittenRecords = 0; numberOfWrittenRecords < numberOfPendingRecords; numberOfWrittenRecords++)
+        {
+            if(pendingLogRecords[numberOfWrittenRecords].sequence != nextSequence)
+            {
+                break;
+            }
+
+            fputs(pendingLogRecords[numberOfWrittenRecords].line, stdout);
+            nextSequence++;
+        }
+
+        numberOfLinesWritten += numberOfWrittenRecords;
+
+        if(numberOfLinesWritten > 0)
+        {
+            fflush(stdout);
+
+            for(tIterator = numberOfWrittenRecords; tIterator < numberOfPendingRecords; tIterator++)
+            {
+                pendingLogRecords[tIterator - numberOfWrittenRecords] = pendingLogRecords[tIterator];
+            }
+
+            numberOfPendingRecords -= numberOfWrittenRecords;
+        }
+        else if(finished)
+        {
+            //All threads have exited and every line they logged has been written
+            pthread_exit(NULL);
+        }
+        else
+        {
+            usleep(LOG_FLUSH_INTERVAL);
+        }
+    }
+}
+
+//Events drive the students when they do not run on threads of their own: in the discrete-event simulation (-s),
+//and as the tasks of the student worker pool (-p). Equal times are ordered by when the events were scheduled.
+enum
+{
+    STUDENT_CODES,       //A student leaves if it got all the help it needed, otherwise it starts coding
+    STUDENT_ARRIVES,     //A student has finished coding and comes to the center
+    TUTORING_FINISHED    //A tutor has finished tutoring a student
+};
+
+typedef struct
+{
+    long long time;      //Microseconds, virtual in the simulation and since the start of the program in the pool
+    long sequence;       //Order in which the event was scheduled
+    int type;
+    int studentId;
+    int tutorId;
+} Event;
+
+Event *events = NULL;   //Binary min-heap ordered by time, then by sequence; one pending event per student at most, and one per tutor
+int numberOfEvents = 0;
+long eventSequence = 0;
+
+int isEarlierEvent(Event *a, Event *b)
+{
+    if(a->time != b->time)
+    {
+        return a->time < b->time;
+    }
+
+    return a->sequence < b->sequence;
+}
+
+void scheduleEvent(long long time, int type, int studentId, int tutorId)
+{
+    Event event;
+    int child = numberOfEvents++;
+    int parent;
+
+    event.time = time;
+    event.sequence = eventSequence++;
+    event.type = type;
+    event.studentId = studentId;
+    event.tutorId = tutorId;
+
+    //Move the event up until its parent is earlier
+    while(child > 0)
+    {
+        parent = (child - 1) / 2;
+
+        if(!isEarlierEvent(&event, &events[parent]))
+        {
+            break;
+        }
+
+        events[child] = events[parent];
+        child = parent;
+    }
+
+    events[child] = event;
+}
+
+//Remove the earliest event. Returns 0 once nothing is left to happen.
+int nextEvent(Event *event)
+{
+    Event last;
+    int parent = 0;
+    int child;
+
+    if(numberOfEvents == 0)
+    {
+        return 0;
+    }
+
+    *event = events[0];
+    last = events[--numberOfEvents];
+
+    //Move the last event down from the root until both children are later
+    while((child = 2 * parent + 1) < numberOfEvents)
+    {
+        if(child + 1 < numberOfEvents && isEarlierEvent(&events[child + 1], &events[child]))
+        {
+            child++;
+        }
+
+        if(!isEarlierEvent(&events[child], &last))
+        {
+            break;
+        }
+
+        events[parent] = events[child];
+        parent = child;
+    }
+
+    events[parent] = last;
+
+    return 1;
+}
+
+//Microseconds since some fixed point in the past, for the student worker pool and the statistics
+long long currentMicroseconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+//Every student draws its coding times from its own generator (xorshift64*), instead of rand(),
+//whose state all threads share behind a lock. Written only by the student, or its task.
+unsigned long long *studentRandomStates = NULL;
+
+//Spreads the seed and the student ID over the whole state (splitmix64), which must not be 0
+void seedStudentRandomState(int studentId)
+{
+    unsigned long long state = randomSeed + studentId * 0x9E3779B97F4A7C15ULL;
+
+    state = (state ^ (state >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    state = (state ^ (state >> 27)) * 0x94D049BB133111EBULL;
+    state ^= state >> 31;
+
+    studentRandomStates[studentId - 1] = (0 == state) ? 1 : state;
+}
+
+//Next number of the student's generator, 0 .. 2^31 - 1 like rand()
+int studentRandom(int studentId)
+{
+    unsigned long long state = studentRandomStates[studentId - 1];
+
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    studentRandomStates[studentId - 1] = state;
+
+    return (int)((state * 0x2545F4914F6CDD1DULL) >> 33);
+}
+
+//Statistics (-c). Each student's entry is written by the student, its wait entry by the tutor that takes it,
+//and each tutor's entry only by that tutor. Chair occupancy is updated under chairsLock.
+typedef struct
+{
+    int requests;                //Times the student took a seat
+    int turnAways;               //Times the student found no empty chair
+    long long seatedTime;        //When the student last took a seat
+} StudentStatistics;
+
+typedef struct
+{
+    long long totalWaitTime;     //Microseconds spent in a chair, in total
+    long long longestWaitTime;
+} StudentWaitStatistics;
+
+typedef struct
+{
+    int sessions;
+    long long busyTime;          //Microseconds spent tutoring
+    long long sessionStartTime;  //When the current session started
+    long long waitHistogram[WAIT_HISTOGRAM_BUCKETS];   //Chair wait times of the students this tutor took, bucket b counting waits below 2^b
+} __attribute__((aligned(CACHE_LINE_SIZE))) TutorStatistics;
+
+StudentStatistics *studentStatistics = NULL;
+StudentWaitStatistics *studentWaitStatistics = NULL;
+TutorStatistics *tutorStatistics = NULL;
+long long *chairOccupancyTime = NULL;   //Microseconds during which exactly k chairs were occupied, k = 0 .. #chairs
+long long lastChairChange = 0;
+long long statisticsStart = 0;
+long long simulationTime = 0;           //Virtual time of the event being simulated
+
+//Real time, or virtual time in the simulation
+long long statisticsClock()
+{
+    return simulationMode ? simulationTime : currentMicroseconds();
+}
+
+//Account for the time spent at the current number of occupied chairs, before it changes. Caller holds chairsLock.
+void recordChairChange()
+{
+    long long now;
+
+    if(NULL == statisticsPrefix)
+    {
+        return;
+    }
+
+    now = statisticsClock();
+    chairOccupancyTime[numberOfOccupiedChairs] += now - lastChairChange;
+    lastChairChange = now;
+}
+
+//A tutor has taken a student out of its chair
+void recordTutoringStart(int tutorIdOfCurrentTutor, int studentId)
+{
+    StudentWaitStatistics *student = &studentWaitStatistics[studentId - 1];
+    TutorStatistics *tutor = &tutorStatistics[tutorIdOfCurrentTutor - numberOfStudents - 1];
+    long long now;
+    long long wait;
+    int bucket = 0;
+
+    if(NULL == statisticsPrefix)
+    {
+        return;
+    }
+
+    now = statisticsClock();
+    tutor->sessionStartTime = now;
+    wait = now - studentStatistics[studentId - 1].seatedTime;
+    student->totalWaitTime += wait;
+
+    if(wait > student->longestWaitTime)
+    {
+        student->longestWaitTime = wait;
+    }
+
+    while(bucket < WAIT_HISTOGRAM_BUCKETS - 1 && (wait >> bucket) > 0)
+    {
+        bucket++;
+    }
+
+    tutor->waitHistogram[bucket]++;
+}
+
+void recordTutoringEnd(int tutorIdOfCurrentTutor)
+{
+    TutorStatistics *tutor = &tutorStatistics[tutorIdOfCurrentTutor - numberOfStudents - 1];
+
+    if(NULL == statisticsPrefix)
+    {
+        return;
+    }
+
+    tutor->sessions++;
+    tutor->busyTime += statisticsClock() - tutor->sessionStartTime;
+}
+
+FILE *openStatisticsFile(const char *name)
+{
+    char fileName[FILENAME_MAX];
+    FILE *file;
+
+    snprintf(fileName, sizeof(fileName), "%s%s", statisticsPrefix, name);
+
+    if(NULL == (file = fopen(fileName, "w")))
+    {
+        fprintf(stderr, "ERROR! Cannot write %s\n", fileName);
+        exit(-1);
+    }
+
+    return file;
+}
+
+//Write the statistics as CSV files, once everything has finished
+void writeStatistics()
+{
+    long long elapsedTime = statisticsClock() - statisticsStart;
+    long long waitHistogram[WAIT_HISTOGRAM_BUCKETS] = { 0 };
+    long long totalWaits = 0;
+    long long waitsSoFar = 0;
+    StudentStatistics *student;
+    StudentWaitStatistics *studentWaits;
+    TutorStatistics *tutor;
+    FILE *file;
+    int tIterator;
+    int bucket;
+
+    //Account for the last stretch of chair occupancy
+    recordChairChange();
+
+    file = openStatisticsFile("students.csv");
+    fprintf(file, "student,requests,turn_aways,sessions,total_wait_us,mean_wait_us,longest_wait_us\n");
+
+    for(tIterator = 0; tIterator < numberOfStudents; tIterator++)
+    {
+        student = &studentStatistics[tIterator];
+        studentWaits = &studentWaitStatistics[tIterator];
+        fprintf(file, "%d,%d,%d,%d,%lld,%lld,%lld\n", tIterator + 1, student->requests, student->turnAways, studentPriorities[tIterator],
+                studentWaits->totalWaitTime, student->requests > 0 ? studentWaits->totalWaitTime / student->requests : 0, studentWaits->longestWaitTime);
+    }
+
+    fclose(file);
+
+    file = openStatisticsFile("tutors.csv");
+    fprintf(file, "tutor,sessions,busy_us,utilization\n");
+
+    for(tIterator = 0; tIterator < numberOfTutors; tIterator++)
+    {
+        tutor = &tutorStatistics[tIterator];
+        fprintf(file, "%d,%d,%lld,%.4f\n", tIterator + 1, tutor->sessions, tutor->busyTime, elapsedTime > 0 ? (double)tutor->busyTime / elapsedTime : 0.0);
+
+        for(bucket = 0; bucket < WAIT_HISTOGRAM_BUCKETS; bucket++)
+        {
+            waitHistogram[bucket] += tutor->waitHistogram[bucket];
+            totalWaits += tutor->waitHistogram[bucket];
+        }
+    }
+
+    fclose(file);
+
+    //The fraction of waits up to each bucket's limit is what a wait-time target is checked against
+    file = openStatisticsFile("waits.csv");
+    fprintf(file, "wait_us_below,sessions,fraction_at_most\n");
+
+    for(bucket = 0; bucket < WAIT_HISTOGRAM_BUCKETS; bucket++)
+    {
+        if(waitHistogram[bucket] == 0)
+        {
+            continue;
+        }
+
+        waitsSoFar += waitHistogram[bucket];
+        fprintf(file, "%lld,%lld,%.6f\n", 1LL << bucket, waitHistogram[bucket], (double)waitsSoFar / totalWaits);
+    }
+
+    fclose(file);
+
+    file = openStatisticsFile("chairs.csv");
+    fprintf(file, "occupied_chairs,time_us,fraction\n");
+
+    for(tIterator = 0; tIterator <= numberOfChairsInWaitingArea; tIterator++)
+    {
+        fprintf(file, "%d,%lld,%.6f\n", tIterator, chairOccupancyTime[tIterator], elapsedTime > 0 ? (double)chairOccupancyTime[tIterator] / elapsedTime : 0.0);
+    }
+
+    fclose(file);
+}
+
+//Returns 1 if request a should be tutored before request b
+int hasHigherPriority(TutoringRequest *a, TutoringRequest *b)
+{
+    //For students with same number of times being tutored, the one who comes first has higher priority
+    if(a->priority != b->priority)
+    {
+        return a->priority < b->priority;
+    }
+
+    return a->sequence < b->sequence;
+}
+
+//Add a request to the priority queue of a partition in O(log #chairs). Caller holds its queueLock.
+void pushPriorityQueue(Partition *partition, TutoringRequest request)
+{
+    TutoringRequest *priorityQueueForTutoring = partition->priorityQueueForTutoring;
+    int child = partition->priorityQueueSize++;
+    int parent;
+
+    //Move the request up until its parent has higher priority
+    while(child > 0)
+    {
+        parent = (child - 1) / 2;
+
+        if(!hasHigherPriority(&request, &priorityQueueForTutoring[parent]))
+        {
+            break;
+        }
+
+        priorityQueueForTutoring[child] = priorityQueueForTutoring[parent];
+        child = parent;
+    }
+
+    priorityQueueForTutoring[child] = request;
+}
+
+//Remove the highest priority request of a partition in O(log #chairs). Returns 0 if the queue is empty. Caller holds its queueLock.
+int popPriorityQueue(Partition *partition, TutoringRequest *request)
+{
+    TutoringRequest *priorityQueueForTutoring = partition->priorityQueueForTutoring;
+    TutoringRequest last;
+    int parent = 0;
+    int child;
+
+    if(partition->priorityQueueSize == 0)
+    {
+        return 0;
+    }
+
+    *request = priorityQueueForTutoring[0];
+    last = priorityQueueForTutoring[--partition->priorityQueueSize];
+
+    //Move the last request down from the root until both children have lower priority
+    while((child = 2 * parent + 1) < partition->priorityQueueSize)
+    {
+        if(child + 1 < partition->priorityQueueSize && hasHigherPriority(&priorityQueueForTutoring[child + 1], &priorityQueueForTutoring[child]))
+        {
+            child++;
+        }
+
+        if(!hasHigherPriority(&priorityQueueForTutoring[child], &last))
+        {
+            break;
+        }
+
+        priorityQueueForTutoring[parent] = priorityQueueForTutoring[child];
+        parent = child;
+    }
+
+    priorityQueueForTutoring[parent] = last;
+
+    return 1;
+}
+
+//Append a node to the arrival queue of a partition. Safe to call from any number of students at once.
+void pushArrivalQueue(Partition *partition, ArrivalNode *node)
+{
+    ArrivalNode *previous;
+
+    node->next = NULL;
+
+    //Claim the end of the queue, then link the previous last node to this one
+    previous = __atomic_exchange_n(&partition->arrivalQueueHead, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&previous->next, node, __ATOMIC_RELEASE);
+}
+
+//Remove the oldest arrival. Returns NULL if the queue is empty, or if the next student is still linking its node; that student posts the coordinator afterwards.
+ArrivalNode *popArrivalQueue(Partition *partition)
+{
+    ArrivalNode *tail = partition->arrivalQueueTail;
+    ArrivalNode *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    //Skip the stub
+    if(tail == &partition->arrivalQueueStub)
+    {
+        if(NULL == next)
+        {
+            return NULL;
+        }
+
+        partition->arrivalQueueTail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if(NULL != next)
+    {
+        partition->arrivalQueueTail = next;
+        return tail;
+    }
+
+    if(tail != __atomic_load_n(&partition->arrivalQueueHead, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    //tail is the last node: put the stub behind it so that tail can be handed out
+    pushArrivalQueue(partition, &partition->arrivalQueueStub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if(NULL != next)
+    {
+        partition->arrivalQueueTail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+//Take the highest priority student of all partitions off its queue, looking at the tutor's own partition first.
+//A tutor whose partition is empty or has only lower priority students steals from another, so the priority rule holds across partitions.
+//Returns 0 if all queues are empty.
+int takeHighestPriorityRequest(int ownPartition, TutoringRequest *request)
+{
+    Partition *partition;
+    TutoringRequest best;
+    int bestPartition;
+    int tIterator;
+    int taken;
+
+    while(1)
+    {
+        bestPartition = -1;
+
+        //Look at the student at the front of each queue
+        for(tIterator = 0; tIterator < numberOfCoordinators; tIterator++)
+        {
+            partition = &partitions[(ownPartition + tIterator) % numberOfCoordinators];
+
+            pthread_mutex_lock(&partition->queueLock);
+
+            if(partition->priorityQueueSize > 0 && (bestPartition == -1 || hasHigherPriority(&partition->priorityQueueForTutoring[0], &best)))
+            {
+                best = partition->priorityQueueForTutoring[0];
+                bestPartition = partition - partitions;
+            }
+
+            pthread_mutex_unlock(&partition->queueLock);
+        }
+
+        if(bestPartition == -1)
+        {
+            return 0;
+        }
+
+        //Take that student, unless another tutor was faster; then look again
+        partition = &partitions[bestPartition];
+
+        pthread_mutex_lock(&partition->queueLock);
+
+        taken = partition->priorityQueueSize > 0 && partition->priorityQueueForTutoring[0].sequence == best.sequence;
+
+        if(taken)
+        {
+            popPriorityQueue(partition, request);
+        }
+
+        pthread_mutex_unlock(&partition->queueLock);
+
+        if(taken)
+        {
+            return 1;
+        }
+    }
+}
+
+//The coordinator moves the students who arrived in its partition to the priority queue, and wakes a tutor for each
+void coordinatorQueuesStudents(int coordinatorIdOfCurrentCoordinator)
+{
+    Partition *partition = &partitions[coordinatorIdOfCurrentCoordinator];
+    ArrivalNode *arrival;
+    TutoringRequest request;
+
+    //Adding each newly arrived student to the priority queue, in order of arrival
+    while(NULL != (arrival = popArrivalQueue(partition)))
+    {
+        //Once queued, the student may be tutored and arrive again with its node, so only the copy is used from here on
+        request = arrival->request;
+
+        pthread_mutex_lock(&partition->queueLock);
+        pushPriorityQueue(partition, request);
+        pthread_mutex_unlock(&partition->queueLock);
+
+        //Acquire lock for shared variable
+        //The line is logged under the lock, so it comes out before any line of a later change to the counters
+        reserveLogLine(numberOfStudentLogRings + numberOfTutors + coordinatorIdOfCurrentCoordinator);
+        pthread_mutex_lock(&chairsLock);
+        logLine(numberOfStudentLogRings + numberOfTutors + coordinatorIdOfCurrentCoordinator, "C: Student %d with priority %d added to the queue. Waiting students now = %d. Total requests = %d\n", request.studentId, request.priority, numberOfOccupiedChairs, totalTutoringRequests);
+        //Release lock for shared variable
+        pthread_mutex_unlock(&chairsLock);
+
+        //Send signal to tutor to call the student with highest priority for tutoring
+        sem_post(&semTutorIsWaitingForCoordinator);
+    }
+}
+
+void *coordinatorThread(void *coordinatorId)
+{
+    int coordinatorIdOfCurrentCoordinator = *(int *)coordinatorId;
+    Partition *partition = &partitions[coordinatorIdOfCurrentCoordinator];
+    int tIterator = 0;
+
+    while(1)
+    {
+        //If all students are helped out, terminate the coordinatorThread and tutorThread
+        if(numberOfStudentsHelped == numberOfStudents)
+        {
+            //Terminate the tutors first; one coordinator is enough for that
+            for(tIterator = 0; coordinatorIdOfCurrentCoordinator == 0 && tIterator < numberOfTutors; tIterator++)
+            {
+                //Sending a signal informing tutors to terminate
+                sem_post(&semTutorIsWaitingForCoordinator);
+            }
+
+            //Then coordinator terminates itself
+            pthread_exit(NULL);
+        }
+
+        //Wait for student's availability notification
+        sem_wait(&partition->semCoordinatorIsWaitingForStudent);
+
+        coordinatorQueuesStudents(coordinatorIdOfCurrentCoordinator);
+    }
+}
+
+//The student has got all the help it needed and leaves
+void studentLeaves(int studentIdOfCurrentStudent)
+{
+    Partition *partition = &partitions[(studentIdOfCurrentStudent - 1) % numberOfCoordinators];
+    int lastStudent;
+    int cIterator;
+
+    //Acquire lock for shared variable
+    pthread_mutex_lock(&statisticsLock);
+
+    numberOfStudentsHelped++;
+    lastStudent = (numberOfStudentsHelped == numberOfStudents);
+
+    //Release lock for shared variable
+    pthread_mutex_unlock(&statisticsLock);
+
+    //Notify coordinate to terminate; the last student notifies every coordinator
+    for(cIterator = 0; cIterator < numberOfCoordinators; cIterator++)
+    {
+        if(lastStudent || &partitions[cIterator] == partition)
+        {
+            sem_post(&partitions[cIterator].semCoordinatorIsWaitingForStudent);
+        }
+    }
+}
+
+//The student has finished coding and comes to the center. Returns 1 if it took a seat, and 0 if no chair was empty.
+int studentTakesSeat(int studentIdOfCurrentStudent)
+{
+    ArrivalNode *arrival = &studentsInWaitingAreaQueue[studentIdOfCurrentStudent - 1];
+    Partition *partition = &partitions[(studentIdOfCurrentStudent - 1) % numberOfCoordinators];
+
+    //Either line below is logged under the lock
+    reserveLogLine(studentLogId(studentIdOfCurrentStudent));
+
+    //Acquire lock for shared variable
+    pthread_mutex_lock(&chairsLock);
+
+    if(numberOfOccupiedChairs >= numberOfChairsInWaitingArea)
+    {
+        logLine(studentLogId(studentIdOfCurrentStudent), "S: Student %d found no empty chair. Will try again later.\n", studentIdOfCurrentStudent);
+        pthread_mutex_unlock(&chairsLock);
+        studentStatistics[studentIdOfCurrentStudent - 1].turnAways++;
+        return 0;
+    }
+
+    recordChairChange();
+    numberOfOccupiedChairs++;
+    totalTutoringRequests++;
+    studentStatistics[studentIdOfCurrentStudent - 1].requests++;
+    studentStatistics[studentIdOfCurrentStudent - 1].seatedTime = lastChairChange;
 
-//Program related arguments
-int numberOfOccupiedChairs = 0;
-int numberOfStudentsHelped = 0;
-int totalTutoringRequests = 0;
-int totalTutoringSessionsHeld = 0;
-int studentsBeingTutoredNow = 0;
+    //The student's position in the waiting queue is the current value of totalTutoringRequests.
+    arrival->request.sequence = totalTutoringRequests;
 
-// thread-functions
-void *coordinatorThread();
-void *studentThread(void *studentId);
-void *tutorThread(void *tutorId);
+    logLine(studentLogId(studentIdOfCurrentStudent), "S: Student %d takes a seat. Empty chairs = %d.\n", studentIdOfCurrentStudent, numberOfChairsInWaitingArea - numberOfOccupiedChairs);
 
-sem_t semCoordinatorIsWaitingForStudent;
-sem_t semTutorIsWaitingForCoordinator;
+    //Release lock for shared variable
+    pthread_mutex_unlock(&chairsLock);
+
+    arrival->request.priority = studentPriorities[studentIdOfCurrentStudent - 1];
+    arrival->request.studentId = studentIdOfCurrentStudent;
+    pushArrivalQueue(partition, arrival);
+
+    //Inform coordinator that student is waiting
+    sem_post(&partition->semCoordinatorIsWaitingForStudent);
 
-pthread_mutex_t chairsLock;
-pthread_mutex_t queueLock;
-pthread_mutex_t tutoringFinishedQueueLock;
+    return 1;
+}
 
-void *coordinatorThread()
+//A tutor has finished tutoring the student
+void studentReceivedHelp(int studentIdOfCurrentStudent)
 {
-    int tIterator = 0;
+    int tutorIdCurrentlyTutoring = (tutoringFinishedQueue[studentIdOfCurrentStudent - 1] - numberOfStudents);
+
+    //The entry is left as it is: only the tutors write tutoringFinishedQueue, and the next tutor overwrites it
+    logLine(studentLogId(studentIdOfCurrentStudent), "S: Student %d received help from Tutor %d.\n", studentIdOfCurrentStudent, tutorIdCurrentlyTutoring);
+
+    //Decrease the priority of student after providing help
+    //Only this student writes its priority, and the coordinator reads it only after the student's next arrival, so no lock is needed
+    studentPriorities[studentIdOfCurrentStudent - 1]++;
+}
+
+void *studentThread(void *studentId)
+{
+    int studentIdOfCurrentStudent = *(int *)studentId;
 
     while(1)
     {
-        //If all students are helped out, terminate the coordinatorThread and tutorThread
-        if(numberOfStudentsHelped == numberOfStudents)
+        if(studentPriorities[studentIdOfCurrentStudent - 1] >= numberOfTimesHelpRequired)
         {
-            //Terminate the tutors first
-            for(tIterator = 0; tIterator < numberOfTutors; tIterator++)
-            {
-                //Sending a signal informing tutors to terminate
-                sem_post(&semTutorIsWaitingForCoordinator);
-            }
-
-            //Then coordinator terminates itself
+            studentLeaves(studentIdOfCurrentStudent);
             pthread_exit(NULL);
         }
 
-        //Wait for student's availability notification
-        sem_wait(&semCoordinatorIsWaitingForStudent);
+        //Student is coding for a random period upto 2ms
+        float codingTime = (float)(studentRandom(studentIdOfCurrentStudent) % CODING_SLEEP_TIME) / 100;
+        usleep(codingTime);
 
-        //Acquire lock for shared variable
-        pthread_mutex_lock(&chairsLock);
-        for(tIterator = 0; tIterator < numberOfStudents; tIterator++)
+        if(!studentTakesSeat(studentIdOfCurrentStudent))
         {
-            //Adding each student to the 2-d priority queue
-            if(studentsInWaitingAreaQueue[tIterator] > -1)
-            {
-                //priorityQueueForTutoring contains 2 variables for each student
-                //0th Index: Student's priority
-                //1st Index: Student's position in the waiting queue
-                priorityQueueForTutoring[tIterator][0] = studentPriorities[tIterator];
-                priorityQueueForTutoring[tIterator][1] = studentsInWaitingAreaQueue[tIterator];
-
-                printf("C: Student %d with priority %d added to the queue. Waiting students now = %d. Total requests = %d\n", studentIdsQueue[tIterator], studentPriorities[tIterator], numberOfOccupiedChairs, totalTutoringRequests);
+            continue;
+        }
 
-                //Clearing the student's position in the waitingAreaQueue and resetting it
-                studentsInWaitingAreaQueue[tIterator] = -1;
+        //Sleep until a tutor has finished tutoring this student
+        sem_wait(&semStudentIsWaitingForTutor[studentIdOfCurrentStudent - 1].semaphore);
 
-                //Send signal to tutor to call the student with highest priority for tutoring
-                sem_post(&semTutorIsWaitingForCoordinator);
-            }
-        }
-        //Release lock for shared variable
-        pthread_mutex_unlock(&chairsLock);
+        studentReceivedHelp(studentIdOfCurrentStudent);
     }
 }
 
-void *studentThread(void *studentId)
+void scheduleStudentTask(long long time, int type, int studentId, int tutorId)
 {
-    int studentIdOfCurrentStudent = *(int *)studentId;
+    pthread_mutex_lock(&studentTaskLock);
+    scheduleEvent(time, type, studentId, tutorId);
+    pthread_cond_signal(&studentTaskReady);
+    pthread_mutex_unlock(&studentTaskLock);
+}
 
-    while(1)
+//One step of a student task: the same steps as studentThread(), but instead of sleeping the task
+//schedules its next step, and while it waits for a tutor it has no step pending at all.
+//Returns 1 if the student left.
+int runStudentTask(Event *event)
+{
+    int studentIdOfCurrentStudent = event->studentId;
+
+    if(event->type == TUTORING_FINISHED)
     {
-        if(studentPriorities[studentIdOfCurrentStudent - 1] >= numberOfTimesHelpRequired)
-        {
-            //Acquire lock for shared variable
-            pthread_mutex_lock(&chairsLock);
+        studentReceivedHelp(studentIdOfCurrentStudent);
+    }
+    else if(event->type == STUDENT_ARRIVES && studentTakesSeat(studentIdOfCurrentStudent))
+    {
+        //A tutor schedules the next step
+        return 0;
+    }
 
-            numberOfStudentsHelped++;
+    if(studentPriorities[studentIdOfCurrentStudent - 1] >= numberOfTimesHelpRequired)
+    {
+        studentLeaves(studentIdOfCurrentStudent);
+        return 1;
+    }
 
-            //Release lock for shared variable
-            pthread_mutex_unlock(&chairsLock);
+    //Student is coding for a random period upto 2ms
+    int codingTime = studentRandom(studentIdOfCurrentStudent) % CODING_SLEEP_TIME / 100;
+    scheduleStudentTask(currentMicroseconds() + codingTime, STUDENT_ARRIVES, studentIdOfCurrentStudent, -1);
 
-            //Notify coordinate to terminate
-            sem_post(&semCoordinatorIsWaitingForStudent);
+    return 0;
+}
 
-            pthread_exit(NULL);
-        }
+//Runs the student tasks as they become due, until every student has left
+void *studentWorkerThread(void *workerId)
+{
+    Event event;
+    struct timespec wakeTime;
+    long long now;
 
-        //Student is coding for a random period upto 2ms
-        float codingTime = (float)(rand() % CODING_SLEEP_TIME) / 100;
-        usleep(codingTime);
+    workerLogId = *(int *)workerId;
 
-        //Acquire lock for shared variable
-        pthread_mutex_lock(&chairsLock);
+    pthread_mutex_lock(&studentTaskLock);
 
-        if(numberOfOccupiedChairs >= numberOfChairsInWaitingArea)
+    while(numberOfStudentsLeft > 0)
+    {
+        if(numberOfEvents == 0)
         {
-            printf("S: Student %d found no empty chair. Will try again later.\n", studentIdOfCurrentStudent);
-            pthread_mutex_unlock(&chairsLock);
+            //All remaining students are waiting for tutors
+            pthread_cond_wait(&studentTaskReady, &studentTaskLock);
             continue;
         }
 
-        numberOfOccupiedChairs++;
-        totalTutoringRequests++;
+        now = currentMicroseconds();
 
-        //All incoming students are initialised with 0 or the current value of totalTutoringRequests.
-        studentsInWaitingAreaQueue[studentIdOfCurrentStudent - 1] = totalTutoringRequests;
+        if(events[0].time > now)
+        {
+            //The earliest student is still coding
+            wakeTime.tv_sec = events[0].time / 1000000;
+            wakeTime.tv_nsec = events[0].time % 1000000 * 1000;
+            pthread_cond_timedwait(&studentTaskReady, &studentTaskLock, &wakeTime);
+            continue;
+        }
 
-        printf("S: Student %d takes a seat. Empty chairs = %d.\n", studentIdOfCurrentStudent, numberOfChairsInWaitingArea - numberOfOccupiedChairs);
+        nextEvent(&event);
 
-        //Release lock for shared variable
-        pthread_mutex_unlock(&chairsLock);
+        pthread_mutex_unlock(&studentTaskLock);
+
+        if(runStudentTask(&event))
+        {
+            pthread_mutex_lock(&studentTaskLock);
+
+            if(--numberOfStudentsLeft == 0)
+            {
+                pthread_cond_broadcast(&studentTaskReady);
+            }
+        }
+        else
+        {
+            pthread_mutex_lock(&studentTaskLock);
+        }
+    }
 
-        //Inform coordinator that student is waiting
-        sem_post(&semCoordinatorIsWaitingForStudent);
+    pthread_mutex_unlock(&studentTaskLock);
 
-        //Wait for tutor to be available
-        while(tutoringFinishedQueue[studentIdOfCurrentStudent - 1] == -1);
+    return NULL;
+}
 
-        int tutorIdCurrentlyTutoring = (tutoringFinishedQueue[studentIdOfCurrentStudent - 1] - numberOfStudents);
+//The tutor takes the waiting student with the highest priority out of its chair. Returns the student's ID, or 0 if nobody is waiting.
+int tutorTakesStudent(int tutorIdOfCurrentTutor)
+{
+    TutoringRequest request;
 
-        printf("S: Student %d received help from Tutor %d.\n", studentIdOfCurrentStudent, tutorIdCurrentlyTutoring);
+    //Taking the student with the highest priority off the queues
+    if(!takeHighestPriorityRequest((tutorIdOfCurrentTutor - numberOfStudents - 1) % numberOfCoordinators, &request))
+    {
+        return 0;
+    }
 
-        //Acquire lock for shared variable
-        pthread_mutex_lock(&tutoringFinishedQueueLock);
+    recordTutoringStart(tutorIdOfCurrentTutor, request.studentId);
 
-        tutoringFinishedQueue[studentIdOfCurrentStudent - 1] = -1;
+    //Decreasing occupied chair count as the student is leaving the chair and will proceed for tutoring
+    pthread_mutex_lock(&chairsLock);
+    recordChairChange();
+    numberOfOccupiedChairs--;
+    pthread_mutex_unlock(&chairsLock);
 
-        //Release lock for shared variable
-        pthread_mutex_unlock(&tutoringFinishedQueueLock);
+    //Since the student left the chair and is moving for tutoring, increment its count
+    pthread_mutex_lock(&statisticsLock);
+    studentsBeingTutoredNow++;
+    pthread_mutex_unlock(&statisticsLock);
 
-        //Decrease the priority of student after providing help
-        //Acquire lock for shared variable
-        pthread_mutex_lock(&chairsLock);
+    return request.studentId;
+}
+
+//The tutor has finished tutoring the student. The caller wakes the student.
+void tutorFinishesTutoring(int tutorIdOfCurrentTutor, int studentId)
+{
+    recordTutoringEnd(tutorIdOfCurrentTutor);
+    reserveLogLine(numberOfStudentLogRings + tutorIdOfCurrentTutor - numberOfStudents - 1);
 
-        studentPriorities[studentIdOfCurrentStudent - 1]++;
+    //After tutoring the student
+    //Acquire lock for shared variable
+    pthread_mutex_lock(&statisticsLock);
 
-        //Release lock for shared variable
-        pthread_mutex_unlock(&chairsLock);
-    }
+    //Since student's tutoring is done, decrement tutoringNow after tutoring.
+    studentsBeingTutoredNow--;
+
+    //Increment the number of sessions held after tutoring
+    totalTutoringSessionsHeld++;
+
+    logLine(numberOfStudentLogRings + tutorIdOfCurrentTutor - numberOfStudents - 1, "T: Student %d tutored by Tutor %d. Students tutored now = %d. Total sessions tutored = %d\n", studentId, tutorIdOfCurrentTutor - numberOfStudents, studentsBeingTutoredNow, totalTutoringSessionsHeld);
+
+    //Release lock for shared variable
+    pthread_mutex_unlock(&statisticsLock);
+
+    //Acquire lock for shared variable
+    pthread_mutex_lock(&tutoringFinishedQueueLock);
+    
+    //Update shared data so student can know who tutored him.
+    tutoringFinishedQueue[studentId - 1] = tutorIdOfCurrentTutor;
+
+    //Release lock for shared variable
+    pthread_mutex_unlock(&tutoringFinishedQueueLock);
 }
 
 void *tutorThread(void *tutorId)
 {
     int tutorIdOfCurrentTutor = *(int *)tutorId;
-    int numberOfTimesStudentIsTutored;
-    int tIterator = 0;
-
-    //For students with same number of times being tutored, the one who comes first has higher priority
-    int studentSequence;
     int studentId;
 
     while(1)
@@ -189,85 +1134,178 @@ void *tutorThread(void *tutorId)
             pthread_exit(NULL);
         }
 
-        numberOfTimesStudentIsTutored = numberOfTimesHelpRequired - 1;
-        studentSequence = numberOfStudents * numberOfTimesHelpRequired + 1;
-        studentId = -1;
-
         //Wait for signal from coordinatorThread to be woken up
         sem_wait(&semTutorIsWaitingForCoordinator);
 
-        //Acquire lock for shared variable
-        pthread_mutex_lock(&chairsLock);
+        if(0 == (studentId = tutorTakesStudent(tutorIdOfCurrentTutor)))
+        {
+            continue;
+        }
 
-        //Getting the latest values of numberOfTimesStudentIsTutored, studentSequence, studentId for each student 
-        for(tIterator = 0; tIterator < numberOfStudents; tIterator++)
+        //Student is being tutored (0.2 ms)
+        usleep(TUTORING_SLEEP_TIME);
+
+        tutorFinishesTutoring(tutorIdOfCurrentTutor, studentId);
+
+        //Wake up the student
+        if(numberOfStudentWorkers > 0)
+        {
+            scheduleStudentTask(currentMicroseconds(), TUTORING_FINISHED, studentId, tutorIdOfCurrentTutor);
+        }
+        else
+        {
+            sem_post(&semStudentIsWaitingForTutor[studentId - 1].semaphore);
+        }
+    }
+}
+
+//Runs the same student, coordinator and tutor steps as the threads, in the order of their events in virtual time.
+//Nobody waits on the semaphores the steps post; the events decide who acts next.
+void runSimulation()
+{
+    Event event;
+    int *idleTutors;                          //Tutor IDs waiting for a student, longest waiting first
+    int firstIdleTutor = 0;
+    int numberOfIdleTutors = 0;
+    int studentId;
+    int tIterator = 0;
+    long long now = 0;
+
+    idleTutors = (int *) malloc(numberOfTutors * sizeof(int));
+
+    if(NULL == idleTutors)
+    {
+        fprintf(stderr, "ERROR! Memory allocation failed\n");
+        exit(-1);
+    }
+
+    for(tIterator = 0; tIterator < numberOfTutors; tIterator++)
+    {
+        idleTutors[numberOfIdleTutors++] = tIterator + numberOfStudents + 1;
+    }
+
+    //Every student starts out coding
+    for(tIterator = 0; tIterator < numberOfStudents; tIterator++)
+    {
+        if(numberOfTimesHelpRequired > 0)
+        {
+            scheduleEvent(studentRandom(tIterator + 1) % SIMULATED_CODING_TIME, STUDENT_ARRIVES, tIterator + 1, -1);
+        }
+    }
+
+    while(nextEvent(&event))
+    {
+        now = simulationTime = event.time;
+
+        if(event.type == STUDENT_ARRIVES)
         {
-            //priorityQueueForTutoring contains 2 variables for each student
-            //0th Index: Student's priority
-            //1st Index: Student's position in the waiting queue
-            if(priorityQueueForTutoring[tIterator][0] > -1 && 
-            priorityQueueForTutoring[tIterator][0] <= numberOfTimesStudentIsTutored && 
-            priorityQueueForTutoring[tIterator][1] < studentSequence)
+            if(!studentTakesSeat(event.studentId))
             {
-                numberOfTimesStudentIsTutored = priorityQueueForTutoring[tIterator][0];
-                studentSequence = priorityQueueForTutoring[tIterator][1];
-                studentId = studentIdsQueue[tIterator];
+                scheduleEvent(now + studentRandom(event.studentId) % SIMULATED_CODING_TIME, STUDENT_ARRIVES, event.studentId, -1);
+                continue;
             }
+
+            //The coordinator queues the student right away
+            coordinatorQueuesStudents((event.studentId - 1) % numberOfCoordinators);
+        }
+        else
+        {
+            tutorFinishesTutoring(event.tutorId, event.studentId);
+            studentReceivedHelp(event.studentId);
+
+            //The student goes back to coding, unless it got all the help it needed
+            if(studentPriorities[event.studentId - 1] < numberOfTimesHelpRequired)
+            {
+                scheduleEvent(now + studentRandom(event.studentId) % SIMULATED_CODING_TIME, STUDENT_ARRIVES, event.studentId, -1);
+            }
+            else
+            {
+                studentLeaves(event.studentId);
+            }
+
+            idleTutors[(firstIdleTutor + numberOfIdleTutors++) % numberOfTutors] = event.tutorId;
         }
 
-        //If the studentId was not updated, he/she is not in the queue
-        if(studentId == -1)
+        //Idle tutors take the waiting students with the highest priority
+        while(numberOfIdleTutors > 0 && 0 != (studentId = tutorTakesStudent(idleTutors[firstIdleTutor])))
         {
-            //Release lock for shared variable
-            pthread_mutex_unlock(&chairsLock);
-            continue;
+            scheduleEvent(now + SIMULATED_TUTORING_TIME, TUTORING_FINISHED, studentId, idleTutors[firstIdleTutor]);
+
+            firstIdleTutor = (firstIdleTutor + 1) % numberOfTutors;
+            numberOfIdleTutors--;
         }
+    }
 
-        //Resetting the priority queue 
-        priorityQueueForTutoring[studentId - 1][0] = -1;
-        priorityQueueForTutoring[studentId - 1][1] = -1;
+    free(idleTutors);
+}
 
-        //Decreasing occupied chair count as the student is leaving the chair and will proceed for tutoring
-        numberOfOccupiedChairs--;
+//Reserves an array of count elements, starting on a cache line of its own, at the end of the state block.
+//Returns where the array is, or NULL while the block is only being measured.
+void *reserveState(char *state, size_t *stateSize, size_t count, size_t elementSize)
+{
+    size_t offset = (*stateSize + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
 
-        //Since the student left the chair and is moving for tutoring, increment its count
-        studentsBeingTutoredNow++;
+    *stateSize = offset + count * elementSize;
 
-        //Release lock for shared variable
-        pthread_mutex_unlock(&chairsLock);
+    return NULL == state ? NULL : state + offset;
+}
 
-        //Student is being tutored (0.2 ms)
-        usleep(TUTORING_SLEEP_TIME);
+//Places every array of the program's state in one block, one array after the other (struct of arrays).
+//Arrays are grouped by the threads writing them and each starts on a new cache line, so students and tutors
+//do not write the same line. The exceptions are the per-student semaphores, which both use and which are padded
+//to a line each, and the arrays under a lock that both take. Returns the size of the block; with state NULL, places nothing.
+size_t layOutState(char *state, int iNumberOfStudents, int iNumberOfTutors, int iNumberOfChairsInWaitingArea, int iNumberOfCoordinators)
+{
+    size_t stateSize = 0;
+    int tIterator;
 
-        //After tutoring the student
-        //Acquire lock for shared variable
-        pthread_mutex_lock(&chairsLock);
+    //Read only once the threads run
+    studentIdsQueue = (int *) reserveState(state, &stateSize, iNumberOfStudents, sizeof(int));
+    tutorIdsQueue = (int *) reserveState(state, &stateSize, iNumberOfTutors, sizeof(int));
+    coordinatorIdsQueue = (int *) reserveState(state, &stateSize, iNumberOfCoordinators, sizeof(int));
 
-        //Since student's tutoring is done, decrement tutoringNow after tutoring.
-        studentsBeingTutoredNow--;
+    //Written by the students
+    studentPriorities = (int *) reserveState(state, &stateSize, iNumberOfStudents, sizeof(int));
+    studentRandomStates = (unsigned long long *) reserveState(state, &stateSize, iNumberOfStudents, sizeof(unsigned long long));
+    studentsInWaitingAreaQueue = (ArrivalNode *) reserveState(state, &stateSize, iNumberOfStudents, sizeof(ArrivalNode));
+    studentStatistics = (StudentStatistics *) reserveState(state, &stateSize, iNumberOfStudents, sizeof(StudentStatistics));
 
-        //Increment the number of sessions held after tutoring
-        totalTutoringSessionsHeld++;
+    //Written by the tutors
+    tutoringFinishedQueue = (int *) reserveState(state, &stateSize, iNumberOfStudents, sizeof(int));
+    studentWaitStatistics = (StudentWaitStatistics *) reserveState(state, &stateSize, iNumberOfStudents, sizeof(StudentWaitStatistics));
+    tutorStatistics = (TutorStatistics *) reserveState(state, &stateSize, iNumberOfTutors, sizeof(TutorStatistics));
 
-        printf("T: Student %d tutored by Tutor %d. Students tutored now = %d. Total sessions tutored = %d\n", studentId, tutorIdOfCurrentTutor - numberOfStudents, studentsBeingTutoredNow, totalTutoringSessionsHeld);
+    //Waited on by the students and posted by the tutors; not needed by the pool
+    semStudentIsWaitingForTutor = (StudentSemaphore *) reserveState(state, &stateSize, (numberOfStudentWorkers > 0) ? 0 : iNumberOfStudents, sizeof(StudentSemaphore));
 
-        //Release lock for shared variable
-        pthread_mutex_unlock(&chairsLock);
+    //Written by the coordinators. Heaps have room for one request per chair, as all waiting students may belong to one partition.
+    partitions = (Partition *) reserveState(state, &stateSize, iNumberOfCoordinators, sizeof(Partition));
 
-        //Acquire lock for shared variable
-        pthread_mutex_lock(&tutoringFinishedQueueLock);
-        
-        //Update shared data so student can know who tutored him.
-        tutoringFinishedQueue[studentId - 1] = tutorIdOfCurrentTutor;
+    for(tIterator = 0; tIterator < iNumberOfCoordinators; tIterator++)
+    {
+        TutoringRequest *heap = (TutoringRequest *) reserveState(state, &stateSize, iNumberOfChairsInWaitingArea, sizeof(TutoringRequest));
 
-        //Release lock for shared variable
-        pthread_mutex_unlock(&tutoringFinishedQueueLock);
+        if(NULL != state)
+        {
+            partitions[tIterator].priorityQueueForTutoring = heap;
+        }
     }
+
+    //Under chairsLock, studentTaskLock, and the logger thread's own
+    chairOccupancyTime = (long long *) reserveState(state, &stateSize, iNumberOfChairsInWaitingArea + 1, sizeof(long long));
+    events = (Event *) reserveState(state, &stateSize, iNumberOfStudents + iNumberOfTutors, sizeof(Event));
+    pendingLogRecords = (LogRecord *) reserveState(state, &stateSize, numberOfLogRings * LOG_RING_SIZE, sizeof(LogRecord));
+
+    //One log ring for each student, each tutor and each coordinator, written by its owner
+    logRings = (LogRing *) reserveState(state, &stateSize, numberOfLogRings, sizeof(LogRing));
+
+    return stateSize;
 }
 
-void initializeVariables(int iNumberOfStudents, int iNumberOfTutors, int iNumberOfChairsInWaitingArea, int iNumberOfTimesHelpRequired)
+void initializeVariables(int iNumberOfStudents, int iNumberOfTutors, int iNumberOfChairsInWaitingArea, int iNumberOfTimesHelpRequired, int iNumberOfCoordinators)
 {
-    int tIterator = 0;
+    void *state = NULL;
+    size_t stateSize;
 
     if(iNumberOfStudents < 1)
     {
@@ -293,93 +1331,196 @@ void initializeVariables(int iNumberOfStudents, int iNumberOfTutors, int iNumber
         exit(-1);
     }
 
-    studentsInWaitingAreaQueue = (int *) malloc(iNumberOfStudents * sizeof(int));
-    studentIdsQueue = (int *) malloc(iNumberOfStudents * sizeof(int));
-    studentPriorities = (int *) malloc(iNumberOfStudents * sizeof(int));
-    tutorIdsQueue = (int *) malloc(iNumberOfTutors * sizeof(int));
-    tutoringFinishedQueue = (int *) malloc(iNumberOfStudents * sizeof(int));
+    if(iNumberOfCoordinators < 1)
+    {
+        fprintf(stderr, "ERROR! There should be at least 1 coordinator\n");
+        exit(-1);
+    }
 
-    //priorityQueueForTutoring contains 2 variables for each student
-    //0th Index: Student's priority
-    //1st Index: Student's position in the waiting queue
-    priorityQueueForTutoring = (int **) malloc(iNumberOfStudents * sizeof(int *));
+    //Sizes of the arrays, then everything in one block
+    numberOfStudentLogRings = (numberOfStudentWorkers > 0) ? numberOfStudentWorkers : iNumberOfStudents;
+    numberOfLogRings = numberOfStudentLogRings + iNumberOfTutors + iNumberOfCoordinators;
+    stateSize = layOutState(NULL, iNumberOfStudents, iNumberOfTutors, iNumberOfChairsInWaitingArea, iNumberOfCoordinators);
 
-    if(NULL == priorityQueueForTutoring)
+    if(0 != posix_memalign(&state, CACHE_LINE_SIZE, stateSize))
     {
         fprintf(stderr, "ERROR! Memory allocation failed\n");
         exit(-1);
     }
 
-    for(tIterator = 0; tIterator < iNumberOfStudents; tIterator++)
-    {
-        priorityQueueForTutoring[tIterator] = (int *) malloc(2 * sizeof(int));
+    memset(state, 0, stateSize);
+    layOutState(state, iNumberOfStudents, iNumberOfTutors, iNumberOfChairsInWaitingArea, iNumberOfCoordinators);
+}
+
+int main(int argc, char *argv[])
+{
+    int tIterator = 0;
+    int option;
+    char *end;
+    pthread_condattr_t studentTaskReadyAttributes;
 
-        if(NULL == priorityQueueForTutoring)
+    //Check for options
+    while((option = getopt(argc, argv, "c:p:r:s")) != -1)
+    {
+        if(option == 's')
         {
-            fprintf(stderr, "ERROR! Memory allocation failed\n");
+            simulationMode = 1;
+        }
+        else if(option == 'c')
+        {
+            statisticsPrefix = optarg;
+        }
+        else if(option == 'r' && (randomSeed = strtoull(optarg, &end, 10), end != optarg && *end == '\0'))
+        {
+            continue;
+        }
+        else if(option == 'p' && (numberOfStudentWorkers = atoi(optarg)) >= 1 && numberOfStudentWorkers <= MAXIMUM_STUDENT_WORKERS)
+        {
+            continue;
+        }
+        else
+        {
+            fprintf(stderr, "ERROR! Unknown option. Usage: csmc [-s | -p #workers] [-c prefix] [-r seed] #students #tutors #chairs #help [#coordinators]\n");
             exit(-1);
         }
     }
 
-    if((NULL == studentsInWaitingAreaQueue) || (NULL == studentIdsQueue) || (NULL == studentPriorities) || (NULL == tutorIdsQueue) || (NULL == tutoringFinishedQueue))
+    //The simulation has no threads to run the students on
+    if(simulationMode && numberOfStudentWorkers > 0)
     {
-        fprintf(stderr, "ERROR! Memory allocation failed\n");
+        fprintf(stderr, "ERROR! -s and -p cannot be used together. Usage: csmc [-s | -p #workers] [-c prefix] [-r seed] #students #tutors #chairs #help [#coordinators]\n");
         exit(-1);
     }
-}
-
-int main(int argc, char *argv[])
-{
-    int tIterator = 0;
 
     //Check for number of passed arguments
-    if(argc != 5)
+    if(argc - optind != 4 && argc - optind != 5)
     {
-        fprintf(stderr, "ERROR! Please provide sufficient arguments: #students, #tutors, #chairs, #help\n");
+        fprintf(stderr, "ERROR! Please provide sufficient arguments: #students, #tutors, #chairs, #help [#coordinators]\n");
         exit(-1);
     }
 
     //Convert arguments from character to integer
-    numberOfStudents = atoi(argv[1]);
-    numberOfTutors = atoi(argv[2]);
-    numberOfChairsInWaitingArea = atoi(argv[3]);
-    numberOfTimesHelpRequired = atoi(argv[4]);
+    numberOfStudents = atoi(argv[optind]);
+    numberOfTutors = atoi(argv[optind + 1]);
+    numberOfChairsInWaitingArea = atoi(argv[optind + 2]);
+    numberOfTimesHelpRequired = atoi(argv[optind + 3]);
+
+    if(argc - optind == 5)
+    {
+        numberOfCoordinators = atoi(argv[optind + 4]);
+    }
 
     //Argument validation and dynamic memory allocation
-    initializeVariables(numberOfStudents, numberOfTutors, numberOfChairsInWaitingArea, numberOfTimesHelpRequired);
+    initializeVariables(numberOfStudents, numberOfTutors, numberOfChairsInWaitingArea, numberOfTimesHelpRequired, numberOfCoordinators);
 
     //Fill default values
     for(tIterator = 0; tIterator < numberOfStudents; tIterator++)
     {
-        studentsInWaitingAreaQueue[tIterator] = -1;
         tutoringFinishedQueue[tIterator] = -1;
-        priorityQueueForTutoring[tIterator][0] = -1;
-        priorityQueueForTutoring[tIterator][1] = -1;
         studentPriorities[tIterator] = 0;
+        seedStudentRandomState(tIterator + 1);
+
+        //Pool workers wake students by scheduling their tasks instead
+        if(numberOfStudentWorkers == 0)
+        {
+            sem_init(&semStudentIsWaitingForTutor[tIterator].semaphore, 0, 0);
+        }
     }
 
     //Initialize lock and semaphores
     //Initialized to 0 as on 1st wait call to sem, the current thread should be allowed and other threads should be blocked
-    sem_init(&semCoordinatorIsWaitingForStudent, 0, 0);
+    for(tIterator = 0; tIterator < numberOfCoordinators; tIterator++)
+    {
+        //Each arrival queue starts out holding only its stub
+        partitions[tIterator].arrivalQueueStub.next = NULL;
+        partitions[tIterator].arrivalQueueHead = &partitions[tIterator].arrivalQueueStub;
+        partitions[tIterator].arrivalQueueTail = &partitions[tIterator].arrivalQueueStub;
+        partitions[tIterator].priorityQueueSize = 0;
+        pthread_mutex_init(&partitions[tIterator].queueLock, NULL);
+        sem_init(&partitions[tIterator].semCoordinatorIsWaitingForStudent, 0, 0);
+    }
+
     sem_init(&semTutorIsWaitingForCoordinator, 0, 0);
     pthread_mutex_init(&chairsLock, NULL);
-    pthread_mutex_init(&queueLock, NULL);
+    pthread_mutex_init(&statisticsLock, NULL);
     pthread_mutex_init(&tutoringFinishedQueueLock, NULL);
 
+    statisticsStart = lastChairChange = statisticsClock();
+
+    //The simulation runs on this thread alone
+    if(simulationMode)
+    {
+        runSimulation();
+
+        if(NULL != statisticsPrefix)
+        {
+            writeStatistics();
+        }
+
+        return 0;
+    }
+
     //Initialize threads
-    pthread_t students[numberOfStudents];
+    pthread_t *students = NULL;
+    pthread_t studentWorkers[MAXIMUM_STUDENT_WORKERS];
+    int studentWorkerIds[MAXIMUM_STUDENT_WORKERS];
     pthread_t tutors[numberOfTutors];
-    pthread_t coordinator;
+    pthread_t coordinators[numberOfCoordinators];
+    pthread_t logger;
 
     //Create threads
-    //Coordinator thread
-    pthread_create(&coordinator, NULL, coordinatorThread, NULL);
+    //Logger thread
+    pthread_create(&logger, NULL, loggerThread, NULL);
+
+    for(tIterator = 0; tIterator < numberOfCoordinators; tIterator++)
+    {
+        coordinatorIdsQueue[tIterator] = tIterator;
+        //Coordinator thread
+        pthread_create(&coordinators[tIterator], NULL, coordinatorThread, (void *)&coordinatorIdsQueue[tIterator]);
+    }
 
     for(tIterator = 0; tIterator < numberOfStudents; tIterator++)
     {
         studentIdsQueue[tIterator] = tIterator + 1;
-        //Student thread
-        pthread_create(&students[tIterator], NULL, studentThread, (void *)&studentIdsQueue[tIterator]);
+    }
+
+    if(numberOfStudentWorkers > 0)
+    {
+        //Every student task starts out coding
+        //Timed waits for coding students use the same clock as currentMicroseconds()
+        pthread_condattr_init(&studentTaskReadyAttributes);
+        pthread_condattr_setclock(&studentTaskReadyAttributes, CLOCK_MONOTONIC);
+        pthread_mutex_init(&studentTaskLock, NULL);
+        pthread_cond_init(&studentTaskReady, &studentTaskReadyAttributes);
+        numberOfStudentsLeft = numberOfStudents;
+
+        for(tIterator = 0; tIterator < numberOfStudents; tIterator++)
+        {
+            scheduleEvent(0, STUDENT_CODES, tIterator + 1, -1);
+        }
+
+        for(tIterator = 0; tIterator < numberOfStudentWorkers; tIterator++)
+        {
+            //Student worker thread
+            studentWorkerIds[tIterator] = tIterator;
+            pthread_create(&studentWorkers[tIterator], NULL, studentWorkerThread, (void *)&studentWorkerIds[tIterator]);
+        }
+    }
+    else
+    {
+        students = (pthread_t *) malloc(numberOfStudents * sizeof(pthread_t));
+
+        if(NULL == students)
+        {
+            fprintf(stderr, "ERROR! Memory allocation failed\n");
+            exit(-1);
+        }
+
+        for(tIterator = 0; tIterator < numberOfStudents; tIterator++)
+        {
+            //Student thread
+            pthread_create(&students[tIterator], NULL, studentThread, (void *)&studentIdsQueue[tIterator]);
+        }
     }
 
     for(tIterator = 0; tIterator < numberOfTutors; tIterator++)
@@ -390,10 +1531,19 @@ int main(int argc, char *argv[])
     }
 
     //Join threads
-    //Coordinator thread
-    pthread_join(coordinator, NULL);
+    for(tIterator = 0; tIterator < numberOfCoordinators; tIterator++)
+    {
+        //Coordinator thread
+        pthread_join(coordinators[tIterator], NULL);
+    }
 
-    for(tIterator = 0; tIterator < numberOfStudents; tIterator++)
+    for(tIterator = 0; tIterator < numberOfStudentWorkers; tIterator++)
+    {
+        //Student worker thread
+        pthread_join(studentWorkers[tIterator], NULL);
+    }
+
+    for(tIterator = 0; students != NULL && tIterator < numberOfStudents; tIterator++)
     {
         //Student thread
         pthread_join(students[tIterator], NULL);
@@ -405,5 +1555,14 @@ int main(int argc, char *argv[])
         pthread_join(tutors[tIterator], NULL);
     }
 
+    //Logger thread writes out what is left, then terminates
+    __atomic_store_n(&loggingFinished, 1, __ATOMIC_RELEASE);
+    pthread_join(logger, NULL);
+
+    if(NULL != statisticsPrefix)
+    {
+        writeStatistics();
+    }
+
     return 0;
 }
@@ -1,36 +1,356 @@
+#define _GNU_SOURCE     // CPU affinity and sched_getcpu()
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
 #include <pthread.h>
-#include <sys/time.h>
+#include <time.h>
+#include <limits.h>
+#include <sched.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #define SOL
-#define NBUCKET 100
-#define NKEYS 100000
+#define NBUCKET 100     // default initial buckets and lock stripes (-b)
+#define NKEYS 100000    // default number of keys (-k)
+#define MAXLOAD 4       // grow the table once entries per bucket exceed this
+#define NCHUNK 4096     // entries reserved at once by a thread's arena
+#define CACHELINE 64
+#define BATCH 8         // keys hashed and prefetched together by get_many(), a multiple of VLANES
+#define VLANES 4        // keys per vector: 128 bits, so a plain SSE2 build does not emulate wider ones
+#define GRAIN 1024      // keys a thread claims at once, and passes to get_many()
+#define HSUB 16         // latency histogram buckets per power of two (2^4)
+#define NHIST (64 * HSUB)
+#define SPINS 4096      // barrier polls before a waiting thread sleeps
+#define RECLAIM 64      // removes between attempts to advance the epoch
+#define RING 512        // slots of each shard ring, a power of two
+#define SBATCH 32       // puts buffered before a shard ring's tail is published
+#define HEATWIDTH 64    // cells per row of the -p stripe heatmap
+#define HEATROWS 16     // rows of the heatmap before stripes share cells
+#define NHOT 5          // stripes listed by the -p report
 
 struct entry {
   int key;
   int value;
   struct entry *next;
 };
-struct entry *table[NBUCKET];
-int keys[NKEYS];
+struct entry **table;   // bucket array, replaced when the table grows
+int nbucket;            // size of table, always nstripe << k
+int nentry;             // number of entries, drives resizing
+unsigned resizeseq;     // odd while grow() relinks entries, see readbegin()
+struct entry **oldtable[32]; // replaced bucket arrays, freed at exit
+int noldtable;
+int nkeys = NKEYS;
+int *keys;
+
+// Each thread allocates entries from its own arena, so put() never goes
+// through the shared malloc() lock except once per NCHUNK entries.
+struct chunk {
+  struct chunk *next;
+  struct entry e[NCHUNK];
+};
+struct arena {
+  struct chunk *chunks;   // chunks reserved by this thread, newest first
+  int used;               // entries handed out from chunks->e
+  struct entry *free;     // entries given back with efree()
+  int nchunk;             // chunks reserved, for -p
+  unsigned long long allocns; // time spent in malloc() for them, for -p
+};
+struct arena *arenas;     // one per thread, released by main() after join
+static __thread struct arena *myarena;
+
+// Epoch-based reclamation of removed entries.  A thread that reads the
+// table without a stripe lock first announces the global epoch.  A
+// removed entry is retired into the remover's limbo list for the global
+// epoch read after the unlink, and goes back to the arena free list only
+// once the global epoch has moved two past it, when no reader can still
+// be looking at it.  The epoch moves on only when every thread inside a
+// read has announced the current one.  Entries are kept in arrays rather
+// than linked through next, which readers may still be following.
+struct ebr {
+  int active;             // nesting depth of enter()
+  unsigned epoch;         // epoch announced by this thread
+  struct entry **limbo[3]; // retired in global epoch e: limbo[e % 3]
+  int nlimbo[3], cap[3];
+  int nretired;
+} __attribute__((aligned(CACHELINE)));
+unsigned epoch;
+struct ebr *ebrs;         // one per thread
+static __thread struct ebr *myebr;
+
+// How put() keeps concurrent inserts into one bucket from losing keys.
+enum { LOCK, CAS, NONE, SHARD };
+char *modename[] = { "lock", "cas", "none", "shard" };
+int mode = LOCK;
+
+// Table layout: chained buckets, or one flat array with linear probing.
+// snap is a read-only table mapped from a snapshot file with -f.
+enum { CHAIN, OPEN, SNAP };
+char *layoutname[] = { "chain", "open", "snap" };
+int layout = CHAIN;
+
+// The open layout packs a key and its value into one 64-bit slot, so a
+// single compare-and-swap claims and fills a slot and a lookup reads a
+// run of adjacent slots instead of chasing next pointers.  Keys are never
+// negative, so a key of -1 marks an empty slot.
+typedef unsigned long long slot_t;
+#define EMPTY (~0ULL)
+#define TOMBSTONE SLOT(-2, 0)
+#define SLOT(k, v) (((slot_t)(unsigned)(k) << 32) | (unsigned)(v))
+#define SLOTKEY(s) ((int)((s) >> 32))
+#define SLOTVALUE(s) ((int)(s))
+slot_t *slots;          // nslot slots, cache line aligned
+int nslot;              // power of two, at least twice nkeys
+int slotshift;          // 32 - log2(nslot), for ohash()
+
+// Shard mode: bucket b belongs to thread b % nthread, which alone writes
+// it, so puts take no lock.  A put of a key owned by another thread goes
+// into the single-producer, single-consumer ring from this thread to the
+// owner, which inserts the keys of its incoming rings in batches.  The
+// ring holds key/value pairs packed like the slots of the open layout.
+struct ring {
+  // written by the producer
+  unsigned tail;          // slots before tail are visible to the consumer
+  unsigned next;          // slots before next are filled
+  unsigned seenhead;      // head when the producer last read it
+  // written by the consumer
+  unsigned head __attribute__((aligned(CACHELINE)));
+  slot_t e[RING] __attribute__((aligned(CACHELINE)));
+} __attribute__((aligned(CACHELINE)));
+struct ring *rings;       // rings[from * nthread + to]
+int sdone;                // threads that have published their last put
+static __thread int myshard; // thread number, the shard this thread owns
+static __thread int sadded;  // entries this thread inserted, added to nentry at the end
+static __thread int sputs;   // puts since this thread last drained its rings
+
+// Snapshot file: a header, nbucket + 1 bucket offsets, then the entries
+// sorted by bucket, so bucket b is entries start[b] .. start[b+1]-1.
+// There are no pointers in the file, so a mapping of it is used as is,
+// at whatever address it lands, and a get only touches the pages of the
+// one bucket it reads.
+#define SNAPMAGIC 0x70616e73    // "snap"
+struct snaphdr {
+  unsigned magic;
+  unsigned nbucket;
+  unsigned nentry;
+  unsigned pad;
+};
+struct snapent {
+  int key;
+  int value;
+};
+char *savefile;         // -w: write the table here after each run
+char *loadfile;         // -f: map this snapshot instead of putting keys
+struct snaphdr *snap;   // the mapped file
+size_t snapsize;
+unsigned *snapstart;    // snap->nbucket + 1 offsets into snapent
+struct snapent *snapent;
+
+int batched = 1;        // get phase uses get_many() rather than lookup()
+int readpct = -1;       // percentage of gets in the mixed phase, -1 for none
+int updatepct;          // percentage of updates in the mixed phase
+int removepct;          // percentage of removes in the mixed phase
+
+// How keys[] is filled: random() keys, a Zipfian draw over nkeys random
+// keys (so a few keys repeat very often), or 0 .. nkeys-1 in order.
+enum { UNIFORM, ZIPF, SEQ };
+char *distname[] = { "uniform", "zipf", "seq" };
+int dist = UNIFORM;
+
+int nrep = 1;           // number of times the whole run is repeated
+int latency;            // record per-operation latency histograms
+int csv;                // print one CSV row per phase instead of text
+
+// Latency histogram in nanoseconds: HSUB linear buckets per power of two,
+// so every bucket is within 1/HSUB of the values it counts.
+struct hist {
+  unsigned long long n[NHIST];
+};
+
+// What one thread measured in one repetition.  Phase 0 is the put or
+// mixed phase, phase 1 the get phase.
+enum { PUT, GET, UPDATE, REMOVE };
+char *opname[] = { "put", "get", "update", "remove" };
+struct result {
+  double t[2];            // seconds spent in each phase
+  int ops[2][4];          // operations per phase and kind
+  int hits;               // mixed-phase gets that found their key
+  int missing;            // keys put but not found in the get phase
+  int cpu, node;          // where the thread ran
+  struct hist h[2][4];    // latency per phase and kind
+};
+struct result *results;   // one per thread
+
+// Threads claim keys in chunks of GRAIN from a shared counter per phase
+// rather than each taking a fixed slice, so any thread count works and a
+// thread that gets descheduled holds up at most one chunk.
+struct work {
+  int next;               // index into keys[] of the next unclaimed chunk
+} __attribute__((aligned(CACHELINE)));
+struct work work[2];    // one per phase
+
+// Thread placement.  compact fills the cores of one socket before moving
+// to the next, scatter deals threads out to the sockets round robin.  A
+// pinned thread reserves its arena itself, so first touch puts its
+// entries on its own NUMA node.
+enum { NOPIN, COMPACT, SCATTER };
+char *pinname[] = { "none", "compact", "scatter" };
+int pin = NOPIN;
+int *cpus;              // cpus[n] is the CPU thread n is pinned to
+
+struct cpu {
+  int id;
+  int package;            // socket
+  int core;               // core within the socket
+  int rank;               // position within its socket in compact order
+};
+
+// GCC vector extensions, so that get_many() hashes and compares in SIMD
+// registers without tying tl.c to one instruction set.  They are 128 bits
+// wide: without -mavx2, GCC splits wider vectors up and runs slower than
+// the scalar code.
+typedef unsigned vkey __attribute__((vector_size(VLANES * sizeof(unsigned))));
+typedef slot_t vslot __attribute__((vector_size(2 * sizeof(slot_t))));
+
 int nthread = 1;
-volatile int done;
+
+// Sense-reversing barrier between the phases.  The last thread to arrive
+// refills count and flips sense, which releases the others.  Waiters poll
+// sense for a while and then sleep on it with futex(), so runs with more
+// threads than cores do not spin away the time the late threads need.
+struct barrier {
+  int count;              // threads that have yet to arrive
+  int sense;              // flipped each time the barrier opens
+  int sleepers;           // waiters blocked in futex()
+  int n;
+} barrier;
+static __thread int mysense; // the sense this thread waits for next
 /** 
  * [Exercise-3]: The following code is added by Shreyans (SSP210009)
  * Added an array of locks
 **/
-pthread_mutex_t lock[NBUCKET]; // declare locks for locking per bucket
+struct stripe {
+  pthread_mutex_t m;
+  // -p counters, written only by the holder of m
+  unsigned long acquired;     // times m was taken
+  unsigned long contended;    // ... of which it was already held
+  unsigned long long waitns;  // time spent waiting for it
+} __attribute__((aligned(CACHELINE))); // one lock per cache line
+struct stripe *lock; // declare locks for locking per bucket
 /* End of code added */
+int nstripe = NBUCKET;
+
+// Bucket b is guarded by lock[b % nstripe].  Because nbucket is always a
+// multiple of nstripe, the stripe of a key does not change when the table
+// grows, so put() can pick its lock before looking at table or nbucket.
+
+// Lock profiling (-p).  Totals over all repetitions, reported at exit.
+int profile;
+int ngrow;                   // resizes done
+unsigned long long growns;   // time every stripe was held by grow()
+int nchunk;                  // arena chunks reserved
+unsigned long long allocns;  // time spent reserving them
+
+static unsigned long long
+nsec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 double
 now()
 {
- struct timeval tv;
- gettimeofday(&tv, 0);
- return tv.tv_sec + tv.tv_usec / 1000000.0;
+  return nsec() / 1000000000.0;
+}
+
+static inline void
+relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+static void
+binit(struct barrier *b, int n)
+{
+  b->count = n;
+  b->sense = 0;
+  b->sleepers = 0;
+  b->n = n;
+}
+
+static void
+bwait(struct barrier *b)
+{
+  int i;
+
+  mysense = !mysense;
+  if (__sync_sub_and_fetch(&b->count, 1) == 0) {
+    b->count = b->n;
+    __atomic_store_n(&b->sense, mysense, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&b->sleepers, __ATOMIC_SEQ_CST) > 0)
+      syscall(SYS_futex, &b->sense, FUTEX_WAKE_PRIVATE, INT_MAX, 0, 0, 0);
+    return;
+  }
+  for (i = 0; i < SPINS; i++) {
+    if (__atomic_load_n(&b->sense, __ATOMIC_ACQUIRE) == mysense)
+      return;
+    relax();
+  }
+  // futex() returns at once if sense flipped after the check above
+  __sync_fetch_and_add(&b->sleepers, 1);
+  while (__atomic_load_n(&b->sense, __ATOMIC_ACQUIRE) != mysense)
+    syscall(SYS_futex, &b->sense, FUTEX_WAIT_PRIVATE, !mysense, 0, 0, 0);
+  __sync_fetch_and_sub(&b->sleepers, 1);
+}
+
+static void
+hadd(struct hist *h, unsigned long long v, int n)
+{
+  int msb;
+
+  if (v < HSUB) {
+    h->n[v] += n;
+    return;
+  }
+  msb = 63 - __builtin_clzll(v);
+  h->n[(msb - 3) * HSUB + ((v >> (msb - 4)) & (HSUB - 1))] += n;
+}
+
+static void
+hmerge(struct hist *h, struct hist *from)
+{
+  int i;
+
+  for (i = 0; i < NHIST; i++)
+    h->n[i] += from->n[i];
+}
+
+// The smallest value of the bucket that holds quantile q.
+static unsigned long long
+hquantile(struct hist *h, double q)
+{
+  unsigned long long total = 0, seen = 0;
+  int i;
+
+  for (i = 0; i < NHIST; i++)
+    total += h->n[i];
+  for (i = 0; i < NHIST; i++) {
+    seen += h->n[i];
+    if (seen > 0 && seen >= q * total)
+      break;
+  }
+  if (i < HSUB)
+    return i;
+  return (unsigned long long)(HSUB + i % HSUB) << (i / HSUB - 1);
 }
 
 static void
@@ -38,7 +358,7 @@ print(void)
 {
   int i;
   struct entry *e;
-  for (i = 0; i < NBUCKET; i++) {
+  for (i = 0; i < nbucket; i++) {
     printf("%d: ", i);
     for (e = table[i]; e != 0; e = e->next) {
       printf("%d ", e->key);
@@ -47,73 +367,1299 @@ print(void)
   }
 }
 
+static struct entry *
+ealloc(void)
+{
+  struct arena *a = myarena;
+  struct chunk *c;
+  struct entry *e;
+
+  if ((e = a->free) != 0) {
+    a->free = e->next;
+    return e;
+  }
+  if (a->chunks == 0 || a->used == NCHUNK) {
+    unsigned long long t = profile ? nsec() : 0;
+    c = malloc(sizeof(struct chunk));
+    assert(c != 0);
+    if (profile) {
+      a->allocns += nsec() - t;
+      a->nchunk++;
+    }
+    c->next = a->chunks;
+    a->chunks = c;
+    a->used = 0;
+  }
+  return &a->chunks->e[a->used++];
+}
+
+static void
+efree(struct entry *e)
+{
+  e->next = myarena->free;
+  myarena->free = e;
+}
+
+// Release every chunk of an arena at once, free list included.
+static void
+arenafree(struct arena *a)
+{
+  struct chunk *c, *next;
+
+  for (c = a->chunks; c != 0; c = next) {
+    next = c->next;
+    free(c);
+  }
+  a->chunks = 0;
+  a->used = 0;
+  a->free = 0;
+}
+
+static void
+enter(void)
+{
+  struct ebr *r = myebr;
+  unsigned g;
+  int i, old;
+
+  if (r == 0 || r->active++ > 0)
+    return;
+  g = __atomic_load_n(&epoch, __ATOMIC_ACQUIRE);
+  if (g != r->epoch) {
+    // everything retired two or more epochs before g is unreachable now
+    old = (g + 1) % 3;
+    for (i = 0; i < r->nlimbo[old]; i++)
+      efree(r->limbo[old][i]);
+    r->nlimbo[old] = 0;
+    __atomic_store_n(&r->epoch, g, __ATOMIC_RELAXED);
+  }
+  // announce before reading a single pointer from the table
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void
+leave(void)
+{
+  struct ebr *r = myebr;
+
+  if (r != 0)
+    __atomic_store_n(&r->active, r->active - 1, __ATOMIC_RELEASE);
+}
+
+static void
+advance(void)
+{
+  unsigned g = __atomic_load_n(&epoch, __ATOMIC_ACQUIRE);
+  int i;
+
+  for (i = 0; i < nthread; i++)
+    if (__atomic_load_n(&ebrs[i].active, __ATOMIC_ACQUIRE) &&
+        __atomic_load_n(&ebrs[i].epoch, __ATOMIC_ACQUIRE) != g)
+      return;
+  __sync_bool_compare_and_swap(&epoch, g, g + 1);
+}
+
+// Called between enter() and leave(), after e was unlinked.  The global
+// epoch may already be one past the announced one, and a reader that
+// entered in it can still hold e, so e is filed under the global epoch.
+static void
+retire(struct entry *e)
+{
+  struct ebr *r = myebr;
+  int l = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST) % 3;
+
+  if (r->nlimbo[l] == r->cap[l]) {
+    r->cap[l] = r->cap[l] ? 2 * r->cap[l] : RECLAIM;
+    r->limbo[l] = realloc(r->limbo[l], r->cap[l] * sizeof(struct entry *));
+    assert(r->limbo[l] != 0);
+  }
+  r->limbo[l][r->nlimbo[l]++] = e;
+  if (++r->nretired % RECLAIM == 0)
+    advance();
+}
+
+// Take stripe i.  With -p, try the lock first so that an uncontended
+// acquisition costs no clock reads; only a thread that has to wait
+// timestamps the wait.
+static void
+slock(int i)
+{
+  struct stripe *s = &lock[i];
+  unsigned long long t;
+
+  if (!profile) {
+    pthread_mutex_lock(&s->m);
+    return;
+  }
+  if (pthread_mutex_trylock(&s->m) != 0) {
+    t = nsec();
+    pthread_mutex_lock(&s->m);
+    s->waitns += nsec() - t;
+    s->contended++;
+  }
+  s->acquired++;
+}
+
+static void
+sunlock(int i)
+{
+  pthread_mutex_unlock(&lock[i].m);
+}
+
 static void 
 insert(int key, int value, struct entry **p, struct entry *n)
 {
-  struct entry *e = malloc(sizeof(struct entry));
+  struct entry *e = ealloc();
   e->key = key;
   e->value = value;
   e->next = n;
-  *p = e;
+  __atomic_store_n(p, e, __ATOMIC_RELEASE); // gets may be walking *p
+}
+
+// Gets do not take the stripe locks, so they may run while other threads
+// put.  A put only ever publishes a fully built entry as a bucket head,
+// which a concurrent get either sees or not.  grow() is the one writer
+// that moves entries, so it bumps resizeseq around the move and a get
+// that overlapped one retries, seqlock style.  Replaced bucket arrays
+// stay allocated until exit because a get may still be reading them.
+static unsigned
+readbegin(void)
+{
+  unsigned seq;
+
+  while ((seq = __atomic_load_n(&resizeseq, __ATOMIC_ACQUIRE)) & 1)
+    ;
+  return seq;
+}
+
+static int
+readretry(unsigned seq)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&resizeseq, __ATOMIC_RELAXED) != seq;
+}
+
+// Double the number of buckets, unless another thread already grew the
+// table past the size seen by the caller.  Holding every stripe keeps puts
+// out while the entries are relinked into the new bucket array.
+static void
+grow(int seen)
+{
+  struct entry **ntable, *e, *next;
+  unsigned long long t = 0;
+  int i, n;
+
+  for (i = 0; i < nstripe; i++)
+    slock(i);
+  if (nbucket == seen) {
+    if (profile)
+      t = nsec();
+    n = nbucket * 2;
+    ntable = calloc(n, sizeof(struct entry *));
+    assert(ntable != 0 && noldtable < 32);
+    __atomic_store_n(&resizeseq, resizeseq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (i = 0; i < nbucket; i++) {
+      for (e = table[i]; e != 0; e = next) {
+        next = e->next;
+        e->next = ntable[e->key % n];
+        ntable[e->key % n] = e;
+      }
+    }
+    oldtable[noldtable++] = table;
+    // a get that reads the new nbucket must also see the larger table
+    table = ntable;
+    __atomic_store_n(&nbucket, n, __ATOMIC_RELEASE);
+    __atomic_store_n(&resizeseq, resizeseq + 1, __ATOMIC_RELEASE);
+    if (profile) {
+      growns += nsec() - t;
+      ngrow++;
+    }
+  }
+  for (i = nstripe - 1; i >= 0; i--)
+    sunlock(i);
+}
+
+// Grow the table ahead of time so that n entries fit without resizing.
+static void
+reserve(int n)
+{
+  while (nbucket * MAXLOAD < n)
+    grow(nbucket);
+}
+
+// Publish the new entry as the bucket head with compare-and-swap instead
+// of taking the stripe lock.  grow() only excludes lock holders, so this
+// mode runs on a table that was sized with reserve() before the threads
+// started.
+static void
+casput(int key, int value)
+{
+  struct entry **p = &table[key % nbucket];
+  struct entry *e = 0, *head, *x, *stop = 0;
+
+  enter();
+  for (;;) {
+    // only entries pushed since the last look can hold the key
+    head = __atomic_load_n(p, __ATOMIC_ACQUIRE);
+    for (x = head; x != stop && x != 0; x = x->next) {
+      if (x->key == key) {
+        __atomic_store_n(&x->value, value, __ATOMIC_RELAXED);
+        if (e != 0)
+          efree(e);     // never published
+        leave();
+        return;
+      }
+    }
+    if (e == 0) {
+      e = ealloc();
+      e->key = key;
+      e->value = value;
+    }
+    e->next = stop = head;
+    if (__sync_bool_compare_and_swap(p, head, e))
+      break;
+  }
+  leave();
+  __sync_add_and_fetch(&nentry, 1);
+}
+
+// Fibonacci hashing: the high bits of key * 2^32/phi index the slots.
+static inline unsigned
+ohash(int key)
+{
+  return ((unsigned)key * 2654435769u) >> slotshift;
+}
+
+static void
+oinit(int n)
+{
+  for (nslot = 1, slotshift = 32; nslot < 2 * n; nslot *= 2, slotshift--)
+    ;
+  slots = aligned_alloc(CACHELINE, nslot * sizeof(slot_t));
+  assert(slots != 0);
+  memset(slots, 0xff, nslot * sizeof(slot_t));
+}
+
+// Claim the first empty slot on the probe sequence, or overwrite the value
+// if the key is already present.  The table is never more than half full,
+// so the probe always ends.
+static void
+oput(int key, int value)
+{
+  unsigned i = ohash(key);
+  slot_t s, n = SLOT(key, value);
+
+  // removed keys leave a TOMBSTONE, which the probe steps over
+  for (;;) {
+    s = slots[i];
+    if (s == EMPTY || SLOTKEY(s) == key) {
+      if (__sync_bool_compare_and_swap(&slots[i], s, n))
+        return;
+      continue;
+    }
+    i = (i + 1) & (nslot - 1);
+  }
+}
+
+// Overwrite the value of key if present; returns 0 if it is not.
+static int
+oupdate(int key, int value)
+{
+  unsigned i = ohash(key);
+  slot_t s;
+
+  for (; (s = slots[i]) != EMPTY; i = (i + 1) & (nslot - 1)) {
+    if (SLOTKEY(s) != key)
+      continue;
+    if (__sync_bool_compare_and_swap(&slots[i], s, SLOT(key, value)))
+      return 1;
+    i = (i - 1) & (nslot - 1);  // the slot changed under us, look again
+  }
+  return 0;
+}
+
+static int
+oremove(int key)
+{
+  unsigned i = ohash(key);
+  slot_t s;
+
+  for (; (s = slots[i]) != EMPTY; i = (i + 1) & (nslot - 1)) {
+    if (SLOTKEY(s) != key)
+      continue;
+    if (__sync_bool_compare_and_swap(&slots[i], s, TOMBSTONE))
+      return 1;
+    i = (i - 1) & (nslot - 1);
+  }
+  return 0;
+}
+
+// Probe for key starting at slot i.
+static int
+oscan(int key, unsigned i, int *value)
+{
+  slot_t s;
+
+  for (; (s = slots[i]) != EMPTY; i = (i + 1) & (nslot - 1)) {
+    if (SLOTKEY(s) == key) {
+      if (value)
+        *value = SLOTVALUE(s);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int
+oget(int key, int *value)
+{
+  return oscan(key, ohash(key), value);
+}
+
+// Like oget(), but compares two slots per step with one vector compare
+// and starts from a slot index that get_many() already computed.
+static int
+ovget(int key, unsigned i, int *value)
+{
+  vslot v, hit, empty;
+  int j;
+
+  for (; i + 2 <= nslot; i += 2) {
+    memcpy(&v, &slots[i], sizeof(v));
+    hit = (v >> 32) == (slot_t)(unsigned)key;
+    empty = v == EMPTY;
+    for (j = 0; j < 2; j++) {
+      if (hit[j]) {
+        *value = SLOTVALUE(v[j]);
+        return 1;
+      }
+      if (empty[j])
+        return 0;
+    }
+  }
+  return oscan(key, i & (nslot - 1), value);
+}
+
+// Insert into a bucket owned by this thread; only the owner writes it.
+static void
+sinsert(int key, int value)
+{
+  int b = key % nbucket;
+  struct entry *e;
+
+  for (e = table[b]; e != 0 && e->key != key; e = e->next)
+    ;
+  if (e != 0) {
+    __atomic_store_n(&e->value, value, __ATOMIC_RELAXED);
+    return;
+  }
+  insert(key, value, &table[b], table[b]);
+  sadded++;
+}
+
+// Insert everything published to this thread's incoming rings; returns
+// the number of puts taken.
+static int
+drain(void)
+{
+  struct ring *r;
+  unsigned h, t;
+  int from, n = 0;
+
+  for (from = 0; from < nthread; from++) {
+    r = &rings[from * nthread + myshard];
+    t = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    for (h = r->head; h != t; h++)
+      sinsert(SLOTKEY(r->e[h & (RING - 1)]), SLOTVALUE(r->e[h & (RING - 1)]));
+    n += t - r->head;
+    __atomic_store_n(&r->head, t, __ATOMIC_RELEASE);
+  }
+  return n;
+}
+
+static void
+publish(struct ring *r)
+{
+  __atomic_store_n(&r->tail, r->next, __ATOMIC_RELEASE);
+}
+
+// Append one put to ring r.  While the ring is full this thread drains
+// its own rings, so two threads filling each other's rings cannot wait on
+// each other forever.
+static void
+push(struct ring *r, slot_t s)
+{
+  while (r->next - r->seenhead == RING) {
+    r->seenhead = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (r->next - r->seenhead == RING) {
+      publish(r);
+      if (drain() == 0)
+        sched_yield();
+    }
+  }
+  r->e[r->next & (RING - 1)] = s;
+  if (++r->next - r->tail >= SBATCH)
+    publish(r);
+}
+
+static void
+sput(int key, int value)
+{
+  int owner = key % nbucket % nthread;
+
+  if (owner == myshard)
+    sinsert(key, value);
+  else
+    push(&rings[myshard * nthread + owner], SLOT(key, value));
+  if (++sputs % SBATCH == 0)
+    drain();
+}
+
+// Called by each thread after its last put: publish what is still
+// buffered, then keep inserting until every other thread has done the
+// same and the incoming rings are empty.
+static void
+sfinish(void)
+{
+  int to, done;
+
+  for (to = 0; to < nthread; to++)
+    publish(&rings[myshard * nthread + to]);
+  __sync_add_and_fetch(&sdone, 1);
+  do {
+    done = __atomic_load_n(&sdone, __ATOMIC_ACQUIRE);
+    if (drain() == 0 && done < nthread)
+      sched_yield();
+  } while (done < nthread);
+  __sync_add_and_fetch(&nentry, sadded);
 }
 
 static 
 void put(int key, int value)
 {
-  int i = key % NBUCKET;
+  if (layout == OPEN) {
+    oput(key, value);
+    return;
+  }
+  if (mode == CAS) {
+    casput(key, value);
+    return;
+  }
+  if (mode == SHARD) {
+    sput(key, value);
+    return;
+  }
+  if (mode == NONE) {
+    // unsynchronized, as in tl_before_modification.c; loses keys
+    insert(key, value, &table[key % nbucket], table[key % nbucket]);
+    return;
+  }
+
+  int i = key % nstripe;
   /** 
   * [Exercise-3]: The following code is modified by Shreyans (SSP210009)
   * Insert lock acquiring and releasing functionality per bucket
   **/
-  pthread_mutex_lock(&lock[i]); // acquire lock per bucket
-  insert(key, value, &table[i], table[i]);
-  pthread_mutex_unlock(&lock[i]); // release lock per bucket
+  slock(i); // acquire lock per bucket
+  int b = key % nbucket;
+  struct entry *e;
+  for (e = table[b]; e != 0 && e->key != key; e = e->next)
+    ;
+  if (e != 0)
+    __atomic_store_n(&e->value, value, __ATOMIC_RELAXED); // gets may read it
+  else
+    insert(key, value, &table[b], table[b]);
+  int size = nbucket;
+  sunlock(i); // release lock per bucket
   /* End of code modified */
+
+  if (e == 0 && __sync_add_and_fetch(&nentry, 1) > size * MAXLOAD)
+    grow(size);
+}
+
+// Set the value of key in place; returns 0 if the key is not present.
+static int
+update(int key, int value)
+{
+  struct entry *e;
+
+  if (layout == OPEN)
+    return oupdate(key, value);
+  if (mode == CAS) {
+    // entries are only ever unlinked under the stripe lock and freed
+    // after the epoch moves on, so this walk needs no lock
+    enter();
+    for (e = __atomic_load_n(&table[key % nbucket], __ATOMIC_ACQUIRE); e != 0; e = e->next)
+      if (e->key == key)
+        break;
+    if (e != 0)
+      __atomic_store_n(&e->value, value, __ATOMIC_RELAXED);
+    leave();
+    return e != 0;
+  }
+  slock(key % nstripe);
+  for (e = table[key % nbucket]; e != 0; e = e->next)
+    if (e->key == key)
+      break;
+  if (e != 0)
+    __atomic_store_n(&e->value, value, __ATOMIC_RELAXED);
+  sunlock(key % nstripe);
+  return e != 0;
+}
+
+// Unlink key and retire its entry; returns 0 if the key is not present.
+// (Named del() because stdio.h already declares remove().)  Removes of
+// one stripe are serialized by its lock.  In cas mode puts can still push
+// new heads meanwhile, so unlinking the head takes a compare-and-swap;
+// interior next pointers are written only by lock holders in any mode.
+static int
+del(int key)
+{
+  struct entry **p, *e;
+  int b;
+
+  if (layout == OPEN)
+    return oremove(key);
+  enter();
+  slock(key % nstripe);
+  b = key % nbucket;
+  for (;;) {
+    for (p = &table[b]; (e = *p) != 0 && e->key != key; p = &e->next)
+      ;
+    if (e == 0)
+      break;
+    if (mode != CAS || p != &table[b]) {
+      __atomic_store_n(p, e->next, __ATOMIC_RELEASE);
+      break;
+    }
+    if (__sync_bool_compare_and_swap(p, e, e->next))
+      break;
+  }
+  sunlock(key % nstripe);
+  if (e != 0) {
+    __sync_sub_and_fetch(&nentry, 1);
+    retire(e);
+  }
+  leave();
+  return e != 0;
 }
 
 static struct entry*
 get(int key)
 {
   struct entry *e = 0;
-  for (e = table[key % NBUCKET]; e != 0; e = e->next) {
-    if (e->key == key) break;
-  }
+  unsigned seq;
+  int n;
+
+  do {
+    seq = readbegin();
+    n = __atomic_load_n(&nbucket, __ATOMIC_ACQUIRE);
+    for (e = __atomic_load_n(&table[key % n], __ATOMIC_ACQUIRE); e != 0; e = e->next) {
+      if (e->key == key) break;
+    }
+  } while (readretry(seq));
   return e;
 }
 
+// Search bucket b of the mapped snapshot.  Within a bucket the newest
+// entry for a key comes first, as in the chain it was saved from.
+static int
+sscan(int key, unsigned b, int *value)
+{
+  unsigned i;
+
+  for (i = snapstart[b]; i < snapstart[b + 1]; i++) {
+    if (snapent[i].key == key) {
+      if (value)
+        *value = snapent[i].value;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Look key up in the layout in use; returns 1 and sets *value if found.
+static int
+lookup(int key, int *value)
+{
+  struct entry *e;
+
+  if (layout == OPEN)
+    return oget(key, value);
+  if (layout == SNAP)
+    return sscan(key, (unsigned)key % snap->nbucket, value);
+  enter();
+  if ((e = get(key)) != 0 && value)
+    *value = e->value;
+  leave();
+  return e != 0;
+}
+
+// Hash m <= BATCH keys, VLANES at a time, with a vector multiply (open)
+// or modulo (chain) and prefetch the slot or bucket each of them probes
+// first.
+static void
+hashbatch(int *k, int m, unsigned *idx)
+{
+  unsigned nb = layout == SNAP ? snap->nbucket :
+                layout == OPEN ? 0 : (unsigned)__atomic_load_n(&nbucket, __ATOMIC_ACQUIRE);
+  vkey v;
+  int j;
+
+  for (j = 0; j < m; j += VLANES) {
+    memset(&v, 0, sizeof(v));
+    memcpy(&v, k + j, (m - j < VLANES ? m - j : VLANES) * sizeof(int));
+    if (layout == OPEN)
+      v = (v * 2654435769u) >> slotshift;
+    else
+      v = v % nb;
+    memcpy(idx + j, &v, sizeof(v));
+  }
+  for (j = 0; j < m; j++) {
+    if (layout == OPEN)
+      __builtin_prefetch(&slots[idx[j]]);
+    else if (layout == SNAP)
+      __builtin_prefetch(&snapstart[idx[j]]);
+    else
+      __builtin_prefetch(&table[idx[j]]);
+  }
+}
+
+// Look up n keys, BATCH at a time.  The next batch is hashed and
+// prefetched before the current one is probed, so the cache misses of a
+// batch overlap instead of being taken one lookup after another.  out[i]
+// is set to the value of k[i], or -1 if it is missing.  Returns the
+// number of keys found.
+static int
+get_many(int *k, int n, int *out)
+{
+  unsigned idx[2][BATCH], seq[2];
+  struct entry *e[BATCH];
+  int i, j, m, found = 0;
+
+  enter();
+  seq[0] = readbegin();
+  hashbatch(k, n < BATCH ? n : BATCH, idx[0]);
+  for (i = 0; i < n; i += BATCH) {
+    unsigned *cur = idx[(i / BATCH) % 2];
+    m = n - i < BATCH ? n - i : BATCH;
+    if (i + BATCH < n) {
+      seq[(i / BATCH + 1) % 2] = readbegin();
+      hashbatch(k + i + BATCH, n - i - BATCH < BATCH ? n - i - BATCH : BATCH,
+                idx[(i / BATCH + 1) % 2]);
+    }
+    if (layout == OPEN) {
+      for (j = 0; j < m; j++) {
+        out[i + j] = -1;
+        found += ovget(k[i + j], cur[j], &out[i + j]);
+      }
+      continue;
+    }
+    if (layout == SNAP) {
+      for (j = 0; j < m; j++)
+        __builtin_prefetch(&snapent[snapstart[cur[j]]]);
+      for (j = 0; j < m; j++) {
+        out[i + j] = -1;
+        found += sscan(k[i + j], cur[j], &out[i + j]);
+      }
+      continue;
+    }
+    // load all bucket heads and prefetch them before walking any chain
+    for (j = 0; j < m; j++) {
+      e[j] = __atomic_load_n(&table[cur[j]], __ATOMIC_ACQUIRE);
+      if (e[j] != 0)
+        __builtin_prefetch(e[j]);
+    }
+    for (j = 0; j < m; j++) {
+      for (; e[j] != 0; e[j] = e[j]->next)
+        if (e[j]->key == k[i + j])
+          break;
+      out[i + j] = e[j] != 0 ? e[j]->value : -1;
+    }
+    // the table grew since this batch was hashed: look its keys up again
+    if (readretry(seq[(i / BATCH) % 2])) {
+      for (j = 0; j < m; j++)
+        if (!lookup(k[i + j], &out[i + j]))
+          out[i + j] = -1;
+    }
+    for (j = 0; j < m; j++)
+      found += out[i + j] != -1;
+  }
+  leave();
+  return found;
+}
+
+// Read one integer from a sysfs file about cpu, or return -1.
+static int
+cpuinfo(char *what, int cpu)
+{
+  char path[128];
+  FILE *f;
+  int v = -1;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/%s", cpu, what);
+  if ((f = fopen(path, "r")) != 0) {
+    if (fscanf(f, "%d", &v) != 1)
+      v = -1;
+    fclose(f);
+  }
+  return v;
+}
+
+// The NUMA node of cpu, from its nodeN link in sysfs, or 0.
+static int
+cpunode(int cpu)
+{
+  char path[64];
+  struct dirent *d;
+  DIR *dir;
+  int node = 0;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  if ((dir = opendir(path)) == 0)
+    return 0;
+  while ((d = readdir(dir)) != 0)
+    if (sscanf(d->d_name, "node%d", &node) == 1)
+      break;
+  closedir(dir);
+  return node;
+}
+
+static int
+bycompact(const void *a, const void *b)
+{
+  const struct cpu *x = a, *y = b;
+
+  if (x->package != y->package)
+    return x->package - y->package;
+  if (x->core != y->core)
+    return x->core - y->core;
+  return x->id - y->id;
+}
+
+static int
+byscatter(const void *a, const void *b)
+{
+  const struct cpu *x = a, *y = b;
+
+  if (x->rank != y->rank)
+    return x->rank - y->rank;
+  return x->package - y->package;
+}
+
+// Choose a CPU for every thread among the CPUs this process may use.
+static void
+placecpus(void)
+{
+  struct cpu *c;
+  cpu_set_t set;
+  int i, n = 0;
+
+  assert(sched_getaffinity(0, sizeof(set), &set) == 0);
+  c = malloc(CPU_COUNT(&set) * sizeof(struct cpu));
+  cpus = malloc(nthread * sizeof(int));
+  assert(c != 0 && cpus != 0);
+  for (i = 0; i < CPU_SETSIZE; i++) {
+    if (!CPU_ISSET(i, &set))
+      continue;
+    c[n].id = i;
+    c[n].package = cpuinfo("topology/physical_package_id", i);
+    c[n].core = cpuinfo("topology/core_id", i);
+    n++;
+  }
+  qsort(c, n, sizeof(struct cpu), bycompact);
+  for (i = 0; i < n; i++)
+    c[i].rank = i > 0 && c[i].package == c[i-1].package ? c[i-1].rank + 1 : 0;
+  if (pin == SCATTER)
+    qsort(c, n, sizeof(struct cpu), byscatter);
+  for (i = 0; i < nthread; i++)
+    cpus[i] = c[i % n].id;
+  free(c);
+}
+
+static void
+genkeys(void)
+{
+  int i, lo, hi, mid;
+  double *cdf, sum = 0, u;
+  int *rank;
+
+  srandom(0);
+  if (dist != ZIPF) {
+    for (i = 0; i < nkeys; i++)
+      keys[i] = dist == SEQ ? i : random();
+    return;
+  }
+
+  // Zipf with exponent 1: the key of rank r is drawn with probability
+  // proportional to 1/r, by binary search over the cumulative weights.
+  rank = malloc(nkeys * sizeof(int));
+  cdf = malloc(nkeys * sizeof(double));
+  assert(rank != 0 && cdf != 0);
+  for (i = 0; i < nkeys; i++) {
+    rank[i] = random();
+    sum += 1.0 / (i + 1);
+    cdf[i] = sum;
+  }
+  for (i = 0; i < nkeys; i++) {
+    u = random() / 2147483648.0 * sum;
+    for (lo = 0, hi = nkeys - 1; lo < hi; ) {
+      mid = (lo + hi) / 2;
+      if (cdf[mid] < u)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    keys[i] = rank[lo];
+  }
+  free(rank);
+  free(cdf);
+}
+
+// Claim the next chunk of phase ph; returns its length, 0 once all
+// nkeys are taken.
+static int
+claim(int ph, int *first)
+{
+  int i = __sync_fetch_and_add(&work[ph].next, GRAIN);
+
+  if (i >= nkeys)
+    return 0;
+  *first = i;
+  return nkeys - i < GRAIN ? nkeys - i : GRAIN;
+}
+
+// The i-th of the nkeys operations of the mixed phase.  With probability
+// readpct%, updatepct% and removepct% it gets, updates or removes the
+// random key *key from the whole key set; otherwise it puts keys[i].  The
+// choice is a hash of i rather than drawn from a per-thread generator, so
+// the workload does not depend on which thread claims i, and the get
+// phase can tell which keys were put.
+static int
+mixop(int i, int *key)
+{
+  unsigned long long x = i + 1;
+  int pct;
+
+  // splitmix64 finalizer
+  x *= 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  pct = x % 100;
+  *key = keys[(x >> 32) % nkeys];
+  if (pct < readpct)
+    return GET;
+  if (pct < readpct + updatepct)
+    return UPDATE;
+  if (pct < readpct + updatepct + removepct)
+    return REMOVE;
+  *key = keys[i];
+  return PUT;
+}
+
+// The mixed phase: the threads work through the nkeys operations of
+// mixop() together, chunk by chunk.
+static void
+mixed(long n, struct result *r)
+{
+  unsigned long long t = 0;
+  int i, m, first, op, key;
+  double t1, t0;
+
+  t0 = now();
+  while ((m = claim(0, &first)) > 0) {
+    for (i = first; i < first + m; i++) {
+      op = mixop(i, &key);
+      if (latency)
+        t = nsec();
+      if (op == GET)
+        r->hits += lookup(key, 0);
+      else if (op == UPDATE)
+        update(key, n);
+      else if (op == REMOVE)
+        del(key);
+      else
+        put(key, n);
+      if (latency)
+        hadd(&r->h[0][op], nsec() - t, 1);
+      r->ops[0][op]++;
+    }
+  }
+  if (mode == SHARD)
+    sfinish();
+  t1 = now();
+  r->t[0] = t1 - t0;
+  if (!csv)
+    printf("%ld: mixed time = %f, %d puts, %d gets, %d hits, %d updates, %d removes\n", n, t1-t0,
+           r->ops[0][PUT], r->ops[0][GET], r->hits, r->ops[0][UPDATE], r->ops[0][REMOVE]);
+}
+
 static void *
 thread(void *xa)
 {
   long n = (long) xa;
-  int i;
-  int b = NKEYS/nthread;
+  int i, j, m, first, key;
   int k = 0;
   double t1, t0;
+  unsigned long long t = 0;
+  struct result *r = &results[n];
+  int *mine, buf[GRAIN], out[GRAIN];
 
-  //  printf("b = %d\n", b);
-  t0 = now();
-  for (i = 0; i < b; i++) {
-    // printf("%d: put %d\n", n, b*n+i);
-    put(keys[b*n + i], n);
+  myarena = &arenas[n];
+  myebr = &ebrs[n];
+  myshard = n;
+  sadded = sputs = 0;
+  r->cpu = sched_getcpu();
+  r->node = cpunode(r->cpu);
+  if (pin != NOPIN && !csv)
+    printf("%ld: cpu %d, node %d\n", n, r->cpu, r->node);
+  if (layout == SNAP) {
+    // the keys are already in the mapped snapshot
+  } else if (readpct >= 0) {
+    mixed(n, r);
+  } else {
+    t0 = now();
+    while ((m = claim(0, &first)) > 0) {
+      for (i = first; i < first + m; i++) {
+        if (latency)
+          t = nsec();
+        put(keys[i], n);
+        if (latency)
+          hadd(&r->h[0][PUT], nsec() - t, 1);
+      }
+      r->ops[0][PUT] += m;
+    }
+    if (mode == SHARD)
+      sfinish();
+    t1 = now();
+    r->t[0] = t1 - t0;
+    if (!csv)
+      printf("%ld: put time = %f\n", n, t1-t0);
   }
-  t1 = now();
-  printf("%ld: put time = %f\n", n, t1-t0);
 
   // Wait for all threads to finish put operations
-  __sync_fetch_and_add(&done, 1);
-  while (done < nthread) ;
+  bwait(&barrier);
 
   t0 = now();
-  for (i = 0; i < b; i++) {
-    struct entry *e = get(keys[n*b + i]);
-    if (e == 0) k++;
+  while ((m = claim(1, &first)) > 0) {
+    // look up the keys of the chunk that were put
+    mine = &keys[first];
+    if (readpct >= 0 && layout != SNAP) {
+      for (i = first, j = 0; i < first + m; i++)
+        if (mixop(i, &key) == PUT)
+          buf[j++] = keys[i];
+      mine = buf;
+      m = j;
+    }
+    if (m == 0)
+      continue;
+    if (batched) {
+      if (latency)
+        t = nsec();
+      k += m - get_many(mine, m, out);
+      // a batched get has no latency of its own; count the average
+      if (latency)
+        hadd(&r->h[1][GET], (nsec() - t) / m, m);
+    } else {
+      for (i = 0; i < m; i++) {
+        if (latency)
+          t = nsec();
+        if (!lookup(mine[i], 0)) k++;
+        if (latency)
+          hadd(&r->h[1][GET], nsec() - t, 1);
+      }
+    }
+    r->ops[1][GET] += m;
   }
   t1 = now();
-  printf("%ld: get time = %f\n", n, t1-t0);
-  printf("%ld: %d keys missing\n", n, k);
+  r->t[1] = t1 - t0;
+  r->missing = k;
+  if (!csv) {
+    printf("%ld: get time = %f\n", n, t1-t0);
+    printf("%ld: %d keys missing\n", n, k);
+  }
   return NULL;
 }
 
+static void
+fail(char *what, char *file)
+{
+  fprintf(stderr, "tl: %s %s\n", what, file);
+  exit(-1);
+}
+
+// Write the table as a snapshot.  Entries are collected in chain order
+// (or slot order for the open layout) and then counting-sorted by bucket,
+// which keeps the newest duplicate of a key ahead of older ones.
+static void
+ssave(char *file)
+{
+  struct snaphdr h;
+  struct snapent *all, *sorted;
+  unsigned *start;
+  struct entry *e;
+  int i, n = 0;
+  FILE *f;
+
+  all = malloc((nkeys + 1) * sizeof(struct snapent));
+  assert(all != 0);
+  if (layout == OPEN) {
+    for (i = 0; i < nslot; i++) {
+      if (slots[i] != EMPTY && slots[i] != TOMBSTONE) {
+        all[n].key = SLOTKEY(slots[i]);
+        all[n++].value = SLOTVALUE(slots[i]);
+      }
+    }
+  } else {
+    for (i = 0; i < nbucket; i++) {
+      for (e = table[i]; e != 0; e = e->next) {
+        all[n].key = e->key;
+        all[n++].value = e->value;
+      }
+    }
+  }
+
+  h.magic = SNAPMAGIC;
+  h.nentry = n;
+  for (h.nbucket = nstripe; h.nbucket * MAXLOAD < n; h.nbucket *= 2)
+    ;
+  h.pad = 0;
+  start = calloc(h.nbucket + 1, sizeof(unsigned));
+  sorted = malloc((n + 1) * sizeof(struct snapent));
+  assert(start != 0 && sorted != 0);
+  for (i = 0; i < n; i++)
+    start[(unsigned)all[i].key % h.nbucket + 1]++;
+  for (i = 0; i < h.nbucket; i++)
+    start[i + 1] += start[i];
+  for (i = 0; i < n; i++)
+    sorted[start[(unsigned)all[i].key % h.nbucket]++] = all[i];
+  // the sort advanced each start[b] to the end of bucket b; shift back
+  memmove(start + 1, start, h.nbucket * sizeof(unsigned));
+  start[0] = 0;
+
+  if ((f = fopen(file, "w")) == 0)
+    fail("cannot create", file);
+  if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+      fwrite(start, sizeof(unsigned), h.nbucket + 1, f) != h.nbucket + 1 ||
+      fwrite(sorted, sizeof(struct snapent), n, f) != n ||
+      fclose(f) != 0)
+    fail("cannot write", file);
+  free(all);
+  free(sorted);
+  free(start);
+}
+
+// Map a snapshot; nothing is read until a get touches it.
+static void
+sload(char *file)
+{
+  struct stat st;
+  int fd;
+
+  if ((fd = open(file, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+    fail("cannot open", file);
+  snapsize = st.st_size;
+  if (snapsize < sizeof(struct snaphdr))
+    fail("not a snapshot:", file);
+  snap = mmap(0, snapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (snap == MAP_FAILED)
+    fail("cannot map", file);
+  if (snap->magic != SNAPMAGIC || snap->nbucket == 0 ||
+      snapsize != sizeof(struct snaphdr) + (snap->nbucket + 1) * sizeof(unsigned)
+                  + snap->nentry * sizeof(struct snapent))
+    fail("not a snapshot:", file);
+  snapstart = (unsigned *)(snap + 1);
+  snapent = (struct snapent *)(snapstart + snap->nbucket + 1);
+}
+
+// Build an empty table and fresh per-thread state for one repetition.
+static void
+setup(void)
+{
+  double t0;
+
+  if (layout == SNAP) {
+    t0 = now();
+    sload(loadfile);
+    if (!csv)
+      printf("snapshot load time = %f, %u entries\n", now() - t0, snap->nentry);
+  }
+  nbucket = nstripe;
+  table = calloc(nbucket, sizeof(struct entry *));
+  assert(table != 0);
+  if (layout == OPEN)
+    oinit(nkeys);
+  else if (mode != LOCK)
+    reserve(nkeys);
+  arenas = calloc(nthread, sizeof(struct arena));
+  results = calloc(nthread, sizeof(struct result));
+  ebrs = aligned_alloc(CACHELINE, nthread * sizeof(struct ebr));
+  assert(arenas != 0 && results != 0 && ebrs != 0);
+  memset(ebrs, 0, nthread * sizeof(struct ebr));
+  epoch = 0;
+  work[0].next = work[1].next = 0;
+  if (mode == SHARD) {
+    rings = aligned_alloc(CACHELINE, nthread * nthread * sizeof(struct ring));
+    assert(rings != 0);
+    memset(rings, 0, nthread * nthread * sizeof(struct ring));
+    sdone = 0;
+  }
+  binit(&barrier, nthread);
+}
+
+static void
+teardown(void)
+{
+  int i;
+
+  free(table);
+  for(i = 0; i < noldtable; i++)
+    free(oldtable[i]);
+  noldtable = 0;
+  nentry = 0;
+  free(slots);
+  slots = 0;
+  if (snap != 0)
+    munmap(snap, snapsize);
+  snap = 0;
+  for(i = 0; i < nthread; i++) {
+    nchunk += arenas[i].nchunk;
+    allocns += arenas[i].allocns;
+    // entries still in limbo live in the arenas and go with them
+    free(ebrs[i].limbo[0]);
+    free(ebrs[i].limbo[1]);
+    free(ebrs[i].limbo[2]);
+    arenafree(&arenas[i]);
+  }
+  free(ebrs);
+  free(rings);
+  rings = 0;
+  free(arenas);
+  free(results);
+}
+
+// Sum up one repetition: per phase and kind of operation, the total
+// operations, the slowest thread's time, and the latency quantiles.
+static void
+report(int rep)
+{
+  static char *phasename[2] = { "put", "get" };
+  struct hist h;
+  double t;
+  int i, ph, op, ops, missing = 0;
+
+  if (readpct >= 0)
+    phasename[0] = "mixed";
+  if (csv && rep == 0)
+    printf("rep,threads,keys,buckets,dist,layout,mode,readpct,updatepct,removepct,batched,affinity,"
+           "phase,op,ops,seconds,mops,p50_ns,p99_ns,p999_ns,missing\n");
+  for (i = 0; i < nthread; i++)
+    missing += results[i].missing;
+  for (ph = 0; ph < 2; ph++) {
+    for (op = PUT; op <= REMOVE; op++) {
+      memset(&h, 0, sizeof(h));
+      for (t = 0, ops = 0, i = 0; i < nthread; i++) {
+        ops += results[i].ops[ph][op];
+        if (results[i].t[ph] > t)
+          t = results[i].t[ph];
+        hmerge(&h, &results[i].h[ph][op]);
+      }
+      if (ops == 0)
+        continue;
+      if (csv) {
+        printf("%d,%d,%d,%d,%s,%s,%s,%d,%d,%d,%d,%s,%s,%s,%d,%f,%f,",
+               rep, nthread, nkeys, nstripe, distname[dist], layoutname[layout],
+               layout == CHAIN ? modename[mode] : layout == OPEN ? "cas" : "-",
+               readpct, updatepct, removepct, batched, pinname[pin],
+               phasename[ph], opname[op], ops, t, ops / t / 1e6);
+        if (latency)
+          printf("%llu,%llu,%llu,", hquantile(&h, 0.5), hquantile(&h, 0.99), hquantile(&h, 0.999));
+        else
+          printf(",,,");
+        printf("%d\n", missing);
+      } else if (latency) {
+        printf("%s phase, %s latency: p50 = %llu ns, p99 = %llu ns, p999 = %llu ns\n",
+               phasename[ph], opname[op],
+               hquantile(&h, 0.5), hquantile(&h, 0.99), hquantile(&h, 0.999));
+      }
+    }
+  }
+}
+
+// The -p report: totals, then one heatmap cell per stripe (or per group of
+// neighbouring stripes when there are too many) shaded by time spent
+// waiting for it, then the stripes waited on longest.  Goes to stderr
+// with -c so that the CSV stays parseable.
+static void
+lockreport(void)
+{
+  static char shade[] = " .:-=+*#%@";
+  FILE *f = csv ? stderr : stdout;
+  unsigned long acquired = 0, contended = 0;
+  unsigned long long wait = 0, max = 0, w;
+  int i, j, c, ncell, per, hot[NHOT], nhot = 0;
+
+  for (i = 0; i < nstripe; i++) {
+    acquired += lock[i].acquired;
+    contended += lock[i].contended;
+    wait += lock[i].waitns;
+  }
+  fprintf(f, "lock profile: %lu acquisitions, %lu contended (%.2f%%), %f s waiting\n",
+          acquired, contended, acquired ? 100.0 * contended / acquired : 0.0, wait / 1e9);
+  fprintf(f, "grow: %d resizes, %f s holding every stripe\n", ngrow, growns / 1e9);
+  fprintf(f, "arenas: %d chunks, %f s in malloc()\n", nchunk, allocns / 1e9);
+
+  per = (nstripe + HEATWIDTH * HEATROWS - 1) / (HEATWIDTH * HEATROWS);
+  ncell = (nstripe + per - 1) / per;
+  for (c = 0; c < ncell; c++) {
+    for (w = 0, j = c * per; j < nstripe && j < (c + 1) * per; j++)
+      w += lock[j].waitns;
+    if (w > max)
+      max = w;
+  }
+  fprintf(f, "wait per stripe, %d stripe%s per cell, ' ' none to '@' most:\n", per, per > 1 ? "s" : "");
+  for (c = 0; c < ncell; c++) {
+    if (c % HEATWIDTH == 0)
+      fprintf(f, "%7d |", c * per);
+    for (w = 0, j = c * per; j < nstripe && j < (c + 1) * per; j++)
+      w += lock[j].waitns;
+    // any wait at all shows up as at least '.'
+    fputc(max == 0 || w == 0 ? ' ' : shade[1 + w * (sizeof(shade) - 3) / max], f);
+    if (c % HEATWIDTH == HEATWIDTH - 1 || c == ncell - 1)
+      fprintf(f, "|\n");
+  }
+
+  // insertion sort of the few longest waits
+  for (i = 0; i < nstripe; i++) {
+    if (lock[i].waitns == 0)
+      continue;
+    if (nhot < NHOT)
+      nhot++;
+    else if (lock[hot[NHOT-1]].waitns >= lock[i].waitns)
+      continue;
+    for (j = nhot - 1; j > 0 && lock[hot[j-1]].waitns < lock[i].waitns; j--)
+      hot[j] = hot[j-1];
+    hot[j] = i;
+  }
+  for (i = 0; i < nhot; i++)
+    fprintf(f, "stripe %d: %lu acquisitions, %lu contended, %f s waiting\n",
+            hot[i], lock[hot[i]].acquired, lock[hot[i]].contended, lock[hot[i]].waitns / 1e9);
+}
+
+static int
+pick(char *name, char **names, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    if (strcmp(name, names[i]) == 0)
+      return i;
+  return -1;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -121,34 +1667,148 @@ main(int argc, char *argv[])
   void *value;
   long i;
   double t1, t0;
+  int c, rep;
+  pthread_attr_t attr;
+  cpu_set_t set;
+
+  while ((c = getopt(argc, argv, "1a:b:cd:f:k:lm:n:pr:t:u:w:x:")) != -1) {
+    switch (c) {
+    case '1':
+      batched = 0;
+      break;
+    case 'a':
+      if ((pin = pick(optarg, pinname, 3)) < 0)
+        goto usage;
+      break;
+    case 'b':
+      if ((nstripe = atoi(optarg)) < 1)
+        goto usage;
+      break;
+    case 'c':
+      csv = 1;
+      break;
+    case 'd':
+      if ((dist = pick(optarg, distname, 3)) < 0)
+        goto usage;
+      break;
+    case 'f':
+      loadfile = optarg;
+      break;
+    case 'k':
+      if ((nkeys = atoi(optarg)) < 1)
+        goto usage;
+      break;
+    case 'l':
+      latency = 1;
+      break;
+    case 'm':
+      if ((mode = pick(optarg, modename, 4)) < 0)
+        goto usage;
+      break;
+    case 'n':
+      if ((nrep = atoi(optarg)) < 1)
+        goto usage;
+      break;
+    case 'p':
+      profile = 1;
+      break;
+    case 'r':
+      readpct = atoi(optarg);
+      if (readpct < 0 || readpct > 100)
+        goto usage;
+      break;
+    case 't':
+      if ((layout = pick(optarg, layoutname, 2)) < 0)
+        goto usage;
+      break;
+    case 'u':
+      if ((updatepct = atoi(optarg)) < 0)
+        goto usage;
+      break;
+    case 'w':
+      savefile = optarg;
+      break;
+    case 'x':
+      if ((removepct = atoi(optarg)) < 0)
+        goto usage;
+      break;
+    default:
+      goto usage;
+    }
+  }
+  if ((updatepct > 0 || removepct > 0) && readpct < 0)
+    readpct = 0;
+  if (readpct + updatepct + removepct > 100 || (removepct > 0 && mode == NONE))
+    goto usage;
+  if (mode == SHARD && (updatepct > 0 || removepct > 0))
+    goto usage;
+  if (loadfile != 0) {
+    if (layout != CHAIN || mode != LOCK || readpct >= 0 || savefile != 0)
+      goto usage;
+    layout = SNAP;
+  }
+  if (optind >= argc || (layout == OPEN && mode != LOCK)) {
+  usage:
+    fprintf(stderr, "%s: %s [-1clp] [-a none|compact|scatter] [-k nkeys] [-b nbucket] [-d uniform|zipf|seq] [-n reps] "
+            "[-r readpct] [-u updatepct] [-x removepct] [-m lock|cas|none|shard | -t open] [-w snapshot | -f snapshot] nthread\n", argv[0], argv[0]);
+    exit(-1);
+  }
+  nthread = atoi(argv[optind]);
+  assert(nthread > 0);
 
   /** 
   * [Exercise-3]: The following code is added by Shreyans (SSP210009)
   * Initialize each lock of the array of locks
   **/
-  for(i = 0; i < NBUCKET; i++){
-    pthread_mutex_init(&lock[i], NULL); // initialize the lock
+  lock = aligned_alloc(CACHELINE, nstripe * sizeof(struct stripe));
+  assert(lock != 0);
+  memset(lock, 0, nstripe * sizeof(struct stripe));
+  for(i = 0; i < nstripe; i++){
+    pthread_mutex_init(&lock[i].m, NULL); // initialize the lock
   }
   /* End of code added */
 
-  if (argc < 2) {
-    fprintf(stderr, "%s: %s nthread\n", argv[0], argv[0]);
-    exit(-1);
-  }
-  nthread = atoi(argv[1]);
   tha = malloc(sizeof(pthread_t) * nthread);
-  srandom(0);
-  assert(NKEYS % nthread == 0);
-  for (i = 0; i < NKEYS; i++) {
-    keys[i] = random();
-  }
-  t0 = now();
-  for(i = 0; i < nthread; i++) {
-    assert(pthread_create(&tha[i], NULL, thread, (void *) i) == 0);
-  }
-  for(i = 0; i < nthread; i++) {
-    assert(pthread_join(tha[i], &value) == 0);
+  keys = malloc(nkeys * sizeof(int));
+  assert(tha != 0 && keys != 0);
+  genkeys();
+  if (pin != NOPIN)
+    placecpus();
+  for (rep = 0; rep < nrep; rep++) {
+    setup();
+    t0 = now();
+    for(i = 0; i < nthread; i++) {
+      pthread_attr_init(&attr);
+      if (pin != NOPIN) {
+        CPU_ZERO(&set);
+        CPU_SET(cpus[i], &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+      }
+      assert(pthread_create(&tha[i], &attr, thread, (void *) i) == 0);
+      pthread_attr_destroy(&attr);
+    }
+    for(i = 0; i < nthread; i++) {
+      assert(pthread_join(tha[i], &value) == 0);
+    }
+    t1 = now();
+    if (!csv) {
+      printf("completion time = %f\n", t1-t0);
+      if (layout == OPEN)
+        printf("layout = open, slots = %d\n", nslot);
+      else if (layout == SNAP)
+        printf("layout = snap, buckets = %u\n", snap->nbucket);
+      else
+        printf("mode = %s, buckets = %d\n", modename[mode], nbucket);
+    }
+    if (savefile != 0)
+      ssave(savefile);
+    report(rep);
+    teardown();
   }
-  t1 = now();
-  printf("completion time = %f\n", t1-t0);
-}
\ No newline at end of file
+  if (profile)
+    lockreport();
+  free(keys);
+  free(cpus);
+  free(lock);
+  free(tha);
+}